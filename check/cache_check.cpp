@@ -0,0 +1,147 @@
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include "check.hpp"
+#include "graph_cache.hpp"
+#include "lru.hpp"
+
+using namespace std;
+
+// The eviction rules under the graph cache: a full cache drops the least recently used entry,
+// get() and put() of a present key make it the most recent one, a smaller capacity evicts the
+// oldest entries first.
+bool lru_check() {
+  bool ok = true;
+  lru::Cache<int, int> cache(3);
+  for (int i = 0; i < 3; ++i) cache.put(i, i * 10);
+
+  EXPECT(cache.get(0) != nullptr && *cache.get(0) == 0);  // 0 is now the most recent
+  cache.put(3, 30);                                       // evicts 1
+  EXPECT(cache.size() == 3 && cache.get(1) == nullptr);
+
+  cache.put(2, 21);  // refreshes 2, 0 becomes the oldest
+  cache.put(4, 40);  // evicts 0
+  EXPECT(cache.get(0) == nullptr);
+  EXPECT(cache.get(2) != nullptr && *cache.get(2) == 21);
+
+  // recency is now 3, 4, 2 from the oldest
+  cache.set_capacity(2);
+  EXPECT(cache.size() == 2 && cache.get(3) == nullptr);
+  EXPECT(cache.get(4) != nullptr && cache.get(2) != nullptr);
+
+  lru::Cache<int, int> disabled(0);
+  EXPECT(disabled.put(1, 1) == nullptr && disabled.empty());
+  return report("LRU check", ok);
+}
+
+struct StubGraph {
+  int id = 0;
+};
+
+// stands for the cuda side of InferImpl::enqueue_graph, counts what the cache asked for
+struct StubRunner : public graph::Runner<StubGraph> {
+  int eager_runs = 0, captures = 0, replays = 0;
+  int replayed = 0;  // id of the last replayed graph
+  bool fail_eager = false, fail_capture = false;
+
+  virtual bool eager() override {
+    eager_runs++;
+    return !fail_eager;
+  }
+
+  virtual shared_ptr<StubGraph> capture() override {
+    if (fail_capture) return nullptr;
+
+    auto graph = make_shared<StubGraph>();
+    graph->id = ++captures;
+    return graph;
+  }
+
+  virtual void replay(const StubGraph &graph) override {
+    replays++;
+    replayed = graph.id;
+  }
+
+  void reset() { eager_runs = captures = replays = replayed = 0; }
+};
+
+// The graph cache of yolo.cu against a stub runner: keys, replay versus capture, invalidation,
+// eviction and the fallback when a capture fails
+bool graph_cache_check() {
+  bool ok = true;
+  uint8_t pixels[4] = {0};
+  auto batch = [&](int n, int width, int height) {
+    return vector<yolo::Image>(n, yolo::Image(pixels, width, height));
+  };
+  vector<yolo::Image> a = batch(2, 640, 480);
+
+  // every field takes part in the key
+  uint64_t key = graph::key(2, yolo::PixelFormat::BGR, 640, 480);
+  EXPECT(key != graph::key(3, yolo::PixelFormat::BGR, 640, 480));
+  EXPECT(key != graph::key(2, yolo::PixelFormat::NV12, 640, 480));
+  EXPECT(key != graph::key(2, yolo::PixelFormat::BGR, 480, 640));
+  EXPECT(key != graph::key(2, yolo::PixelFormat::BGR, 640, 481));
+
+  // disabled: always eager
+  graph::Cache<StubGraph> cache;
+  StubRunner runner;
+  EXPECT(!cache.enabled() && cache.run(a.data(), 2, runner));
+  EXPECT(runner.eager_runs == 1 && runner.captures == 0 && cache.size() == 0);
+
+  // first run of a key runs eagerly once, then captures; the next ones replay
+  cache.set_capacity(2);
+  runner.reset();
+  EXPECT(cache.run(a.data(), 2, runner));
+  EXPECT(runner.eager_runs == 1 && runner.captures == 1 && runner.replays == 0);
+  EXPECT(cache.run(a.data(), 2, runner) && cache.run(a.data(), 2, runner));
+  EXPECT(runner.eager_runs == 1 && runner.captures == 1 && runner.replays == 2);
+  EXPECT(runner.replayed == 1);
+
+  // another batch size, resolution or format is another graph
+  vector<yolo::Image> b = batch(1, 640, 480);
+  vector<yolo::Image> c = batch(2, 640, 480);
+  for (auto &image : c) image.format = yolo::PixelFormat::NV12;
+  EXPECT(cache.run(b.data(), 1, runner) && runner.captures == 2);
+  EXPECT(cache.run(a.data(), 2, runner) && runner.replayed == 1);
+
+  // capacity 2: c evicts b, the least recently used
+  EXPECT(cache.run(c.data(), 2, runner) && runner.captures == 3 && cache.size() == 2);
+  EXPECT(cache.run(b.data(), 1, runner) && runner.captures == 4);
+
+  // mixed resolutions and per image options never use a graph
+  runner.reset();
+  vector<yolo::Image> mixed = batch(2, 640, 480);
+  mixed[1].width = 320;
+  vector<yolo::Image> with_options = batch(2, 640, 480);
+  with_options[0].options = make_shared<yolo::ImageOptions>();
+  EXPECT(!cache.usable(mixed.data(), 2) && !cache.usable(with_options.data(), 2));
+  EXPECT(cache.run(mixed.data(), 2, runner) && cache.run(with_options.data(), 2, runner));
+  EXPECT(runner.eager_runs == 2 && runner.captures == 0 && runner.replays == 0);
+
+  // a setting change or a moved buffer drops every graph, the next run captures again
+  runner.reset();
+  cache.check_moved(pixels, pixels);
+  EXPECT(cache.size() == 2);
+  cache.check_moved(pixels, pixels + 1);
+  EXPECT(cache.size() == 0);
+  EXPECT(cache.run(a.data(), 2, runner) && runner.captures == 1 && runner.eager_runs == 1);
+  cache.clear();
+  EXPECT(cache.run(a.data(), 2, runner) && runner.captures == 2 && runner.replays == 0);
+
+  // a failed capture is remembered: that key runs eagerly without capturing again
+  cache.clear();
+  runner.reset();
+  runner.fail_capture = true;
+  EXPECT(cache.run(a.data(), 2, runner) && cache.run(a.data(), 2, runner));
+  EXPECT(runner.eager_runs == 2 && runner.replays == 0 && cache.size() == 1);
+  runner.fail_capture = false;
+  EXPECT(cache.run(a.data(), 2, runner) && runner.eager_runs == 3 && runner.captures == 0);
+
+  // a failing eager run is reported and nothing is captured
+  runner.reset();
+  runner.fail_eager = true;
+  EXPECT(!cache.run(b.data(), 1, runner) && runner.captures == 0);
+  return report("Graph cache check", ok);
+}
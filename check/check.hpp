@@ -0,0 +1,32 @@
+#ifndef __CHECK_HPP__
+#define __CHECK_HPP__
+
+#include <stdio.h>
+
+// Checks of the host code run by make check. Each one prints "[name]: passed" or "FAILED" and
+// the conditions that failed, and returns false on failure.
+
+// inside a check, ok is its local result
+#define EXPECT(cond)                                               \
+  do {                                                             \
+    if (!(cond)) {                                                 \
+      printf("    %s:%d: expect %s\n", __FILE__, __LINE__, #cond); \
+      ok = false;                                                  \
+    }                                                              \
+  } while (0)
+
+inline bool report(const char *name, bool ok) {
+  printf("[%s]: %s\n", name, ok ? "passed" : "FAILED");
+  return ok;
+}
+
+bool lru_check();
+bool graph_cache_check();
+bool pinned_pool_check();
+bool tile_check();
+bool mosaic_check();
+bool motion_check();
+bool cpm_decimate_check();
+bool cpm_fair_check();
+
+#endif  // __CHECK_HPP__
@@ -0,0 +1,121 @@
+#include <chrono>
+#include <future>
+#include <memory>
+#include <vector>
+
+#include "check.hpp"
+#include "cpm.hpp"
+
+using namespace std;
+
+// model of cpm::Instance that returns its inputs. The first call blocks until release is set, so
+// the queue fills up behind it; the inputs of the next calls are recorded in order.
+struct EchoModel {
+  promise<void> entered;
+  shared_future<void> release;
+  bool first = true;
+  vector<int> order;
+
+  vector<int> forwards(const vector<int> &inputs, void *stream) {
+    if (first) {
+      first = false;
+      entered.set_value();
+      release.wait();
+    } else {
+      order.insert(order.end(), inputs.begin(), inputs.end());
+    }
+    return inputs;
+  }
+};
+
+typedef cpm::Instance<int, int, EchoModel> EchoInstance;
+
+// target_fps against a clock set by the check: the kept rate never exceeds the target (the first
+// commit aside), commits up to half a period early are kept and a burst keeps one
+bool cpm_decimate_check() {
+  bool ok = true;
+  auto start = chrono::steady_clock::now();
+  chrono::steady_clock::time_point now = start;
+  auto at_ms = [&](double ms) {
+    now = start + chrono::duration_cast<chrono::steady_clock::duration>(
+                      chrono::duration<double, milli>(ms));
+  };
+
+  // not started, the kept commits only wait in the queue
+  EchoInstance cpmi;
+  cpmi.set_clock([&] { return now; });
+  cpmi.set_stream(0, 1, 25);
+  cpmi.set_stream(1, 1, 25);
+  cpmi.set_stream(2, 1, 25);
+
+  // ten seconds of 100 fps into 25 fps
+  shared_future<int> dropped;
+  for (int i = 0; i < 1000; ++i) {
+    at_ms(i * 10.0);
+    shared_future<int> future = cpmi.commit(i, 0);
+    if (i == 1) dropped = future;
+  }
+  cpm::StreamStats stats = cpmi.stream_stats(0);
+  uint64_t kept = stats.committed - stats.decimated;
+  EXPECT(stats.committed == 1000 && kept >= 250 && kept <= 251);
+  bool decimated = false;
+  try {
+    dropped.get();
+  } catch (const cpm::Decimated &) {
+    decimated = true;
+  }
+  EXPECT(decimated);
+
+  // 25 fps arriving 15 ms early, inside half a period (20 ms): all kept
+  for (int i = 0; i < 100; ++i) {
+    at_ms(20000 + i * 40.0 - (i > 0 ? 15 : 0));
+    cpmi.commit(i, 1);
+  }
+  stats = cpmi.stream_stats(1);
+  EXPECT(stats.committed == 100 && stats.decimated == 0);
+
+  // ten commits at one instant keep one, the next period keeps one more
+  at_ms(30000);
+  for (int i = 0; i < 10; ++i) cpmi.commit(i, 2);
+  at_ms(30040);
+  cpmi.commit(10, 2);
+  stats = cpmi.stream_stats(2);
+  EXPECT(stats.committed == 11 && stats.decimated == 9);
+  return report("CPM decimate check", ok);
+}
+
+// Weighted fair batching: with weights 4:1 and both streams backlogged, the first 40 items split
+// 32:8 whatever the batch size, also when a batch fills in the middle of a stream's turn
+bool cpm_fair_check() {
+  bool ok = true;
+  for (int batch : {1, 2, 3, 5}) {
+    auto model = make_shared<EchoModel>();
+    promise<void> release;
+    model->release = release.get_future().share();
+    shared_future<void> entered = model->entered.get_future().share();
+
+    EchoInstance cpmi;
+    EXPECT(cpmi.start([&] { return model; }, batch));
+    cpmi.set_stream(0, 4);
+    cpmi.set_stream(1, 1);
+
+    // the worker blocks on the first item while both streams queue 50 each
+    cpmi.commit(-1);
+    entered.wait();
+    vector<shared_future<int>> futures;
+    for (int i = 0; i < 50; ++i) {
+      futures.push_back(cpmi.commit(0, 0));
+      futures.push_back(cpmi.commit(1, 1));
+    }
+    release.set_value();
+    for (auto &future : futures) future.wait();
+    cpmi.stop();
+
+    int counts[2] = {0, 0};
+    for (int i = 0; i < 40 && i < (int)model->order.size(); ++i) counts[model->order[i]]++;
+    EXPECT(model->order.size() == 100);
+    EXPECT(counts[0] == 32 && counts[1] == 8);
+    if (counts[0] != 32) printf("    batch %d: %d:%d\n", batch, counts[0], counts[1]);
+  }
+  return report("CPM fair check", ok);
+}
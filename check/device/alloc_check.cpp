@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <new>
+#include <opencv2/opencv.hpp>
+
+#include "yolo.hpp"
+
+// Allocations of warmed forwards_into on the gpu, make alloc_check. A binary of its own: the
+// counter replaces operator new/delete for the whole process, opencv and tensorrt included.
+
+static std::atomic<size_t> num_allocations(0);
+
+void *operator new(size_t size) {
+  num_allocations++;
+  void *ptr = malloc(size ? size : 1);
+  if (ptr == nullptr) throw std::bad_alloc();
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept { free(ptr); }
+
+static yolo::Image cvimg(const cv::Mat &image) {
+  return yolo::Image(image.data, image.cols, image.rows, image.step);
+}
+
+// Steady state forwards_into: after warmup, and a few calls that size the output BoxArrays, a
+// detection model must not allocate at all
+int main() {
+  int batch = 16;
+  auto yolo = yolo::load("yolov8n.transd.engine", yolo::Type::V8);
+  if (yolo == nullptr) {
+    printf("[Allocation check]: FAILED, can not load yolov8n.transd.engine\n");
+    return 1;
+  }
+  yolo->warmup(batch);
+
+  std::vector<cv::Mat> images{cv::imread("inference/car.jpg"), cv::imread("inference/gril.jpg"),
+                              cv::imread("inference/group.jpg")};
+  std::vector<yolo::Image> yoloimages(batch);
+  for (int i = 0; i < batch; ++i) yoloimages[i] = cvimg(images[i % images.size()]);
+
+  std::vector<yolo::BoxArray> out(batch);
+  auto count_allocations = [&](const char *name) {
+    for (int i = 0; i < 3; ++i) yolo->forwards_into(yoloimages, out.data());
+
+    int ntest = 20;
+    size_t before = num_allocations;
+    for (int i = 0; i < ntest; ++i) yolo->forwards_into(yoloimages, out.data());
+    size_t count = num_allocations - before;
+    printf("[Allocations of %d warmed forwards_into, %s]: %d, %s\n", ntest, name, (int)count,
+           count == 0 ? "passed" : "FAILED");
+    return count == 0;
+  };
+  bool ok = count_allocations("default");
+
+  // the detection caps and the class tables of per image options use the scratch of the model
+  yolo::DecodeOptions caps;
+  caps.max_detections = 10;
+  caps.max_per_class = 3;
+  yolo->set_decode_options(caps);
+  auto options = std::make_shared<yolo::ImageOptions>();
+  options->decode.classes = {0, 2, 5, 7};
+  options->decode.class_thresholds = {0.3f, 0.25f, 0.4f};
+  for (auto &image : yoloimages) image.options = options;
+  ok = count_allocations("caps and options") && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,18 @@
+#include "check.hpp"
+#include "yolo.hpp"
+
+// defined in yolo.cu, which the host checks do not link
+yolo::Norm yolo::Norm::None() { return yolo::Norm(); }
+
+int main() {
+  bool ok = true;
+  ok = lru_check() && ok;
+  ok = graph_cache_check() && ok;
+  ok = pinned_pool_check() && ok;
+  ok = tile_check() && ok;
+  ok = mosaic_check() && ok;
+  ok = motion_check() && ok;
+  ok = cpm_decimate_check() && ok;
+  ok = cpm_fair_check() && ok;
+  return ok ? 0 : 1;
+}
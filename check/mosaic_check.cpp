@@ -0,0 +1,107 @@
+#include <math.h>
+#include <stdint.h>
+
+#include <tuple>
+#include <vector>
+
+#include "check.hpp"
+#include "mosaic.hpp"
+
+using namespace std;
+
+static bool near(float a, float b) { return fabs(a - b) < 1e-3f; }
+
+// canvas box of a box of the source image, through the i2d of its placement
+static yolo::Box to_canvas(const mosaic::Placement &item, float left, float top, float right,
+                           float bottom) {
+  return yolo::Box(item.i2d[0] * left + item.i2d[2], item.i2d[4] * top + item.i2d[5],
+                   item.i2d[0] * right + item.i2d[2], item.i2d[4] * bottom + item.i2d[5], 0.9f,
+                   item.index);
+}
+
+// Placement of mosaic::pack (inside the canvas, apart by the spacing, overflow onto a new canvas,
+// large images shrunk) and the boxes of unpack going back to their source image
+bool mosaic_check() {
+  bool ok = true;
+  mosaic::Config config;
+  config.canvas_width = 640;
+  config.canvas_height = 640;
+  config.spacing = 8;
+
+  // four 300x300 fill a canvas as 2x2, the fifth overflows, the 1280x960 shrinks to 624x468
+  vector<tuple<int, int>> sizes(5, make_tuple(300, 300));
+  sizes.emplace_back(1280, 960);
+  sizes.emplace_back(100, 50);
+  vector<mosaic::Placement> placements = mosaic::pack(sizes, config);
+  EXPECT(placements.size() == sizes.size());
+
+  int per_canvas[8] = {0};
+  for (size_t i = 0; i < placements.size(); ++i) {
+    const mosaic::Placement &item = placements[i];
+    EXPECT(item.index == (int)i && item.canvas >= 0 && item.canvas < 8);
+    if (item.canvas < 0 || item.canvas >= 8) continue;
+
+    per_canvas[item.canvas]++;
+    EXPECT(item.x >= config.spacing && item.y >= config.spacing);
+    EXPECT(item.x + item.width + config.spacing <= config.canvas_width);
+    EXPECT(item.y + item.height + config.spacing <= config.canvas_height);
+    for (size_t j = 0; j < i; ++j) {
+      const mosaic::Placement &other = placements[j];
+      if (other.canvas != item.canvas) continue;
+      bool apart = item.x >= other.x + other.width + config.spacing ||
+                   other.x >= item.x + item.width + config.spacing ||
+                   item.y >= other.y + other.height + config.spacing ||
+                   other.y >= item.y + item.height + config.spacing;
+      EXPECT(apart);
+    }
+  }
+  EXPECT(placements[5].width == 624 && placements[5].height == 468);
+  EXPECT(near(placements[5].scale, 624 / 1280.0f));
+  for (int i = 0; i < 5; ++i)
+    EXPECT(placements[i].width == 300 && placements[i].scale == 1.0f);
+  EXPECT(mosaic::num_canvases(placements) == 3);
+  EXPECT(per_canvas[0] == 1 && per_canvas[1] == 4 && per_canvas[2] == 2);
+
+  // a canvas without room for any image packs nothing
+  mosaic::Config tiny = config;
+  tiny.canvas_width = 16;
+  EXPECT(mosaic::pack(sizes, tiny).empty());
+
+  // Boxes go back to the image holding their center: exact at scale 1, scaled back for the
+  // shrunk image, clipped to the source; a center in the spacing belongs to no image
+  vector<yolo::BoxArray> canvas_boxes(mosaic::num_canvases(placements));
+  const mosaic::Placement &small = placements[2], &large = placements[5];
+  canvas_boxes[small.canvas].push_back(to_canvas(small, 10, 20, 110, 120));
+  canvas_boxes[small.canvas].push_back(to_canvas(small, 240, 250, 340, 290));  // past the edge
+  canvas_boxes[large.canvas].push_back(to_canvas(large, 640, 480, 960, 720));
+  canvas_boxes[small.canvas].emplace_back(small.x - 6, small.y, small.x - 2, small.y + 10, 0.9f,
+                                          99);
+  vector<yolo::BoxArray> output = mosaic::unpack(canvas_boxes, placements, placements.size());
+  EXPECT(output.size() == placements.size());
+  for (size_t i = 0; i < output.size(); ++i) {
+    for (auto &box : output[i]) EXPECT(box.class_label == (int)i);
+  }
+  EXPECT(output[2].size() == 2 && output[5].size() == 1);
+  if (output[2].size() == 2 && output[5].size() == 1) {
+    const yolo::Box &a = output[2][0], &b = output[2][1], &c = output[5][0];
+    EXPECT(near(a.left, 10) && near(a.top, 20) && near(a.right, 110) && near(a.bottom, 120));
+    EXPECT(near(b.left, 240) && near(b.right, 300) && near(b.bottom, 290));
+    EXPECT(near(c.left, 640) && near(c.top, 480) && near(c.right, 960) && near(c.bottom, 720));
+  }
+
+  // forward: the canvases run in chunks of max_batch with the nms of the model turned off
+  vector<uint8_t> pixels(300 * 300 * 3, 0);
+  vector<yolo::Image> images(5, yolo::Image(pixels.data(), 300, 300));
+  config.max_batch = 1;
+  int calls = 0;
+  bool no_nms = true;
+  auto forwards = [&](const vector<yolo::Image> &chunk) {
+    calls++;
+    for (auto &image : chunk)
+      no_nms = no_nms && image.options && image.options->nms_threshold == 1.0f;
+    return vector<yolo::BoxArray>(chunk.size());
+  };
+  output = mosaic::forward(forwards, images, config);
+  EXPECT(output.size() == images.size() && calls == 2 && no_nms);
+  return report("Mosaic check", ok);
+}
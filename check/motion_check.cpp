@@ -0,0 +1,62 @@
+#include <stdint.h>
+
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "check.hpp"
+#include "motion.hpp"
+
+using namespace std;
+
+// stands for cpm::Instance, the check settles the futures of the commits
+struct StubInstance {
+  vector<shared_ptr<promise<yolo::BoxArray>>> promises;
+
+  shared_future<yolo::BoxArray> commit(const yolo::Image &image, int stream) {
+    promises.push_back(make_shared<promise<yolo::BoxArray>>());
+    return promises.back()->get_future().share();
+  }
+};
+
+// Gate::commit: skipped frames share the future of the last forwarded one while it is pending or
+// succeeded, a failed one is committed again with the skipped frame
+bool motion_check() {
+  bool ok = true;
+  const int width = 128, height = 72;
+  vector<uint8_t> still(width * height * 3, 60), moved(width * height * 3, 200);
+  yolo::Image a(still.data(), width, height), b(moved.data(), width, height);
+
+  motion::Config config;
+  config.refresh_interval = 0;
+  motion::Gate gate(config);
+  StubInstance instance;
+
+  // the first frame is forwarded, a still frame shares its future while pending
+  gate.commit(instance, a);
+  EXPECT(instance.promises.size() == 1);
+  shared_future<yolo::BoxArray> skipped = gate.commit(instance, a);
+  EXPECT(instance.promises.size() == 1 && gate.skipped() == 1);
+  EXPECT(skipped.wait_for(chrono::seconds(0)) == future_status::timeout);
+
+  // the forwarded frame failed (superseded, decimated...): the next still frame is committed
+  instance.promises[0]->set_exception(make_exception_ptr(runtime_error("dropped")));
+  gate.commit(instance, a);
+  EXPECT(instance.promises.size() == 2 && gate.skipped() == 1 && gate.frames() == 3);
+  if (instance.promises.size() != 2) return report("Motion check", false);
+
+  // a successful one is shared by the still frames
+  instance.promises[1]->set_value(yolo::BoxArray(1, yolo::Box(1, 2, 3, 4, 0.9f, 0)));
+  for (int i = 0; i < 3; ++i) {
+    shared_future<yolo::BoxArray> reused = gate.commit(instance, a);
+    EXPECT(reused.wait_for(chrono::seconds(0)) == future_status::ready);
+    EXPECT(reused.get().size() == 1);
+  }
+  EXPECT(instance.promises.size() == 2 && gate.skipped() == 4);
+
+  // a change is forwarded as before
+  gate.commit(instance, b);
+  EXPECT(instance.promises.size() == 3 && gate.skipped() == 4 && gate.frames() == 7);
+  return report("Motion check", ok);
+}
@@ -0,0 +1,105 @@
+#include <stdarg.h>
+#include <stdlib.h>
+
+#include <memory>
+#include <vector>
+
+#include "check.hpp"
+#include "infer.hpp"
+
+using namespace std;
+
+// infer.cu is not linked here, the pool reports its failures through this
+void trt::__log_func(const char *file, int line, const char *fmt, ...) {
+  va_list vl;
+  va_start(vl, fmt);
+  printf("    ");
+  vprintf(fmt, vl);
+  printf("\n");
+  va_end(vl);
+}
+
+// malloc in place of cudaMallocHost, counts the calls of the pool
+struct MallocAllocator : public trt::HostAllocator {
+  int allocations = 0, releases = 0, registrations = 0, unregistrations = 0;
+  bool fail_register = false;
+
+  virtual void *allocate(size_t bytes) override {
+    allocations++;
+    return malloc(bytes);
+  }
+
+  virtual void release(void *ptr) override {
+    releases++;
+    free(ptr);
+  }
+
+  virtual bool register_memory(void *ptr, size_t bytes) override {
+    if (fail_register) return false;
+    registrations++;
+    return true;
+  }
+
+  virtual void unregister_memory(void *ptr) override { unregistrations++; }
+};
+
+// PinnedPool without a device: reuse of released buffers, the max_cached_bytes bound, the pinned
+// ranges and leases that outlive the pool
+bool pinned_pool_check() {
+  bool ok = true;
+  auto allocator = make_shared<MallocAllocator>();
+  auto pool = trt::create_pinned_pool(allocator, 1500);
+  EXPECT(pool != nullptr && pool->lease(0) == nullptr);
+
+  // a leased buffer is pinned over its whole size
+  shared_ptr<unsigned char> a = pool->lease(1000);
+  unsigned char *pa = a.get();
+  EXPECT(a != nullptr && allocator->allocations == 1);
+  EXPECT(pool->is_pinned(pa, 1000) && pool->is_pinned(pa + 500, 500));
+  EXPECT(!pool->is_pinned(pa + 500, 501));
+
+  // released buffers return to the pool and serve leases up to twice smaller
+  a.reset();
+  EXPECT(pool->num_free() == 1 && pool->cached_bytes() == 1000 && allocator->releases == 0);
+  a = pool->lease(800);
+  EXPECT(a.get() == pa && allocator->allocations == 1 && pool->num_free() == 0);
+  EXPECT(pool->is_pinned(pa, 1000));
+  shared_ptr<unsigned char> small = pool->lease(400);
+  EXPECT(small.get() != pa && allocator->allocations == 2);
+
+  // above max_cached_bytes a released buffer goes back to the allocator and is no longer pinned
+  shared_ptr<unsigned char> b = pool->lease(1000);
+  unsigned char *pb = b.get();
+  a.reset();
+  b.reset();
+  EXPECT(pool->num_free() == 1 && pool->cached_bytes() == 1000 && allocator->releases == 1);
+  EXPECT(pool->is_pinned(pa, 1000) && !pool->is_pinned(pb, 1000));
+
+  // registered caller memory, once per range, its sub-ranges are pinned too
+  vector<unsigned char> frame(4096);
+  EXPECT(pool->register_memory(frame.data(), frame.size()) && allocator->registrations == 1);
+  EXPECT(pool->register_memory(frame.data() + 64, 128) && allocator->registrations == 1);
+  EXPECT(pool->is_pinned(frame.data() + 1024, 1024));
+  EXPECT(!pool->is_pinned(frame.data() + 1024, 4096));
+  pool->unregister_memory(frame.data());
+  EXPECT(allocator->unregistrations == 1 && !pool->is_pinned(frame.data(), 16));
+
+  // only registered ranges are unregistered, a failed registration is not pinned
+  pool->unregister_memory(small.get());
+  EXPECT(allocator->unregistrations == 1 && pool->is_pinned(small.get(), 400));
+  allocator->fail_register = true;
+  EXPECT(!pool->register_memory(frame.data(), frame.size()));
+  EXPECT(!pool->is_pinned(frame.data(), 16));
+  allocator->fail_register = false;
+
+  // a lease that outlives the pool is freed by the allocator; the pool frees its cached buffers
+  // and unregisters what is still registered
+  EXPECT(pool->register_memory(frame.data(), frame.size()));
+  int releases = allocator->releases;
+  pool.reset();
+  EXPECT(allocator->releases == releases + 1 && allocator->unregistrations == 2);
+  small.reset();
+  EXPECT(allocator->releases == releases + 2);
+  EXPECT(allocator->allocations == allocator->releases);
+  return report("Pinned pool check", ok);
+}
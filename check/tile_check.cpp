@@ -0,0 +1,120 @@
+#include <stdint.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "check.hpp"
+#include "tile.hpp"
+
+using namespace std;
+
+// starts of the tiles along one axis, in order
+static vector<int> axis_starts(const vector<tile::Tile> &tiles, bool x_axis) {
+  vector<int> starts;
+  for (auto &tile : tiles) starts.push_back(x_axis ? tile.x : tile.y);
+  sort(starts.begin(), starts.end());
+  starts.erase(unique(starts.begin(), starts.end()), starts.end());
+  return starts;
+}
+
+// One axis of make_tiles: the tiles cover [0, size), start even, keep the configured size (the
+// last one takes the pixel lost by the even rounding) and overlap by at least overlap * tile
+static bool check_axis(const vector<tile::Tile> &tiles, bool x_axis, int size, int tile_size,
+                       float overlap) {
+  bool ok = true;
+  vector<int> starts = axis_starts(tiles, x_axis);
+  int covered = 0;
+  for (size_t i = 0; i < starts.size(); ++i) {
+    auto iter = find_if(tiles.begin(), tiles.end(), [&](const tile::Tile &tile) {
+      return (x_axis ? tile.x : tile.y) == starts[i];
+    });
+    int length = x_axis ? iter->width : iter->height;
+    int expect = std::min(size, tile_size);
+    EXPECT(starts[i] % 2 == 0);
+    EXPECT(starts[i] <= covered);
+    EXPECT(length == expect || (i + 1 == starts.size() && length == expect + 1));
+    if (i > 0) EXPECT(covered - starts[i] >= (int)(overlap * tile_size) - 2);
+    covered = starts[i] + length;
+  }
+  EXPECT(covered == size);
+  return ok;
+}
+
+// Tile layout of make_tiles and the merge of the boxes across tile seams
+bool tile_check() {
+  bool ok = true;
+  tile::Config config;
+  config.tile_width = 640;
+  config.tile_height = 640;
+  config.overlap = 0.2f;
+
+  // odd sizes: the last start is rounded down to even and its tile takes the extra pixel
+  vector<tile::Tile> tiles = tile::make_tiles(1921, 1081, config);
+  EXPECT(tiles.size() == 4 * 2);
+  EXPECT(check_axis(tiles, true, 1921, 640, 0.2f));
+  EXPECT(check_axis(tiles, false, 1081, 640, 0.2f));
+
+  // an axis smaller than a tile is one tile spanning it, both axes give a single tile
+  tiles = tile::make_tiles(2000, 300, config);
+  EXPECT(check_axis(tiles, true, 2000, 640, 0.2f));
+  EXPECT(axis_starts(tiles, false).size() == 1);
+  for (auto &tile : tiles) EXPECT(tile.y == 0 && tile.height == 300);
+  tiles = tile::make_tiles(500, 300, config);
+  EXPECT(tiles.size() == 1 && tiles[0].width == 500 && tiles[0].height == 300);
+  EXPECT(tile::make_tiles(0, 300, config).empty());
+
+  // A fake model sees two objects through the crops: one straddles the seam of the first two
+  // tiles, one tile sees it whole and the other clipped; the merge keeps one whole box for each
+  const int width = 1920, height = 640;
+  vector<uint8_t> pixels((size_t)width * height * 3);
+  yolo::Image image(pixels.data(), width, height);
+  const yolo::Box objects[] = {yolo::Box(500, 100, 560, 160, 0.9f, 0),
+                               yolo::Box(1500, 300, 1600, 400, 0.8f, 2)};
+  int calls = 0, crops = 0;
+  auto forwards = [&](const vector<yolo::Image> &images) {
+    calls++;
+    vector<yolo::BoxArray> result(images.size());
+    for (size_t i = 0; i < images.size(); ++i) {
+      const yolo::Image &crop = images[i];
+      size_t offset = (const uint8_t *)crop.bgrptr - pixels.data();
+      float x = offset % (width * 3) / 3, y = offset / (width * 3);
+      crops++;
+      for (const yolo::Box &object : objects) {
+        float left = std::max(object.left - x, 0.0f);
+        float top = std::max(object.top - y, 0.0f);
+        float right = std::min(object.right - x, (float)crop.width);
+        float bottom = std::min(object.bottom - y, (float)crop.height);
+        // a cut object is less certain, the whole one wins the nms
+        float visible = (right - left) * (bottom - top) /
+                        ((object.right - object.left) * (object.bottom - object.top));
+        if (left < right && top < bottom)
+          result[i].emplace_back(left, top, right, bottom, object.confidence * visible,
+                                 object.class_label);
+      }
+    }
+    return result;
+  };
+
+  config.full_frame = false;
+  config.max_batch = 2;
+  tiles = tile::make_tiles(width, height, config);
+  yolo::BoxArray boxes = tile::forward(forwards, image, config);
+  EXPECT(crops == (int)tiles.size() && calls == ((int)tiles.size() + 1) / 2);
+  EXPECT(boxes.size() == 2);
+  for (const yolo::Box &object : objects) {
+    bool found = false;
+    for (auto &box : boxes) {
+      found = found || (box.class_label == object.class_label && box.left == object.left &&
+                        box.top == object.top && box.right == object.right &&
+                        box.bottom == object.bottom);
+    }
+    EXPECT(found);
+  }
+
+  // the full frame is one more image of the batches and merges as well
+  config.full_frame = true;
+  calls = crops = 0;
+  boxes = tile::forward(forwards, image, config);
+  EXPECT(crops == (int)tiles.size() + 1 && boxes.size() == 2);
+  return report("Tile check", ok);
+}
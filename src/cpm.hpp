@@ -3,16 +3,60 @@
 
 // Comsumer Producer Model
 
+#include <stdint.h>
+
 #include <algorithm>
+#include <chrono>
 #include <condition_variable>
+#include <deque>
+#include <functional>
 #include <future>
+#include <map>
 #include <memory>
-#include <queue>
+#include <stdexcept>
 #include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "lru.hpp"
 
 namespace cpm
 {
 
+  // 邮箱模式下被同一个流的新输入替换的item，其future.get()抛出该异常
+  struct Superseded : public std::runtime_error
+  {
+    Superseded() : std::runtime_error("superseded by a newer input of the same stream") {}
+  };
+
+  // 超过流的target_fps而被丢弃的输入，其future.get()抛出该异常
+  struct Decimated : public std::runtime_error
+  {
+    Decimated() : std::runtime_error("dropped to keep the target fps of the stream") {}
+  };
+
+  // 每个流的统计
+  struct StreamStats
+  {
+    uint64_t committed = 0;      // 提交的输入
+    uint64_t decimated = 0;      // 超过target_fps被丢弃
+    uint64_t superseded = 0;     // 邮箱模式下被替换
+    uint64_t completed = 0;      // 完成推理(不含去重命中)
+    double latency_mean_ms = 0;  // 从提交到结果的延迟
+    double latency_max_ms = 0;
+    double latency_last_ms = 0;
+  };
+
+  // 每个流的顺序交付统计
+  struct SequencerStats
+  {
+    uint64_t delivered = 0;   // 按提交顺序交付的结果
+    uint64_t skipped = 0;     // 超出重排窗口时仍未完成，不再交付
+    uint64_t held = 0;        // 已完成但等待更早的结果而推迟交付
+    double hold_mean_ms = 0;  // held的结果被推迟的时间
+    double hold_max_ms = 0;
+  };
+
   // 模板类
   template <typename Result, typename Input, typename Model>
   class Instance
@@ -25,16 +69,66 @@ namespace cpm
       // std::promise是C++中用于异步编程的一种机制，可用于在一个线程中设置一个值，并在另外一个线程中获取这个值
       // pro用于存储一个异步操作的结果，被定义为shared_ptr，可在多个地方被共享，并且没有任何引用时会自动释放内存
       std::shared_ptr<std::promise<Result>> pro;
+      // 分桶的key，同一个batch中的所有item来自同一个桶，未设置bucket_key_时都为0
+      uint64_t bucket = 0;
+      // 去重的key，dedup为true时该item完成后从in_flight_中移除，结果放入recent_
+      bool dedup = false;
+      uint64_t key = 0;
+      // 提交时指定的流id，-1表示不属于任何流
+      int stream = -1;
+      std::chrono::steady_clock::time_point time;
+    };
+
+    // 队列中或正在推理的去重item，sharers为去重命中后共享其future的提交数
+    struct InFlight
+    {
+      std::shared_future<Result> future;
+      int sharers = 0;
+    };
+
+    // 流的调度状态
+    struct StreamState
+    {
+      float weight = 1;
+      float target_fps = 0;
+      float deficit = 0;  // 加权差额轮询中剩余的额度
+      std::chrono::steady_clock::time_point next_time;  // 下一个不被丢弃的提交时间
+      StreamStats stats;
+    };
+
+    // 顺序交付中等待交付的结果
+    struct SequenceEntry
+    {
+      uint64_t sequence = 0;
+      std::shared_future<Result> future;
+      bool ready = false;
+      std::chrono::steady_clock::time_point ready_time;
+    };
+
+    struct Sequence
+    {
+      uint64_t next = 0;  // 下一个提交的序号
+      std::deque<SequenceEntry> entries;
+      SequencerStats stats;
+    };
+
+    // 释放sequence_lock_之后要回调的结果
+    struct Delivery
+    {
+      int stream;
+      uint64_t sequence;
+      std::shared_future<Result> future;
     };
 
     // std::condition_variable是C++中的一个同步原语，用于线程之间的条件变量通信
     // 允许一个或者多个线程等待某个条件成立，直到其他线程满足条件后通知等待的线程继续执行
     // cond_用作线程间的条件变量
     std::condition_variable cond_;
-    // std::queue是C++中的一个容器适配器，用于实现队列数据结构，提供先进先出的元素访问方式
-    // input_queue_用作一个队列，存储Item类型的对象
-    // 通过调用input_queue_.push()将Item类型的对象添加到队列尾部, 并通过调用input_queue_.pop()从队列头部中移除一个Item类型的对象
-    std::queue<Item> input_queue_;
+    // std::deque是C++中的双端队列，可以在两端高效地添加和移除元素，也可以遍历和移除中间的元素
+    // input_queue_用作一个先进先出的队列，存储Item类型的对象
+    // 通过调用input_queue_.push_back()将Item类型的对象添加到队列尾部, 并通过调用input_queue_.pop_front()从队列头部中移除一个Item类型的对象
+    // 使用deque而不是queue，分桶取batch时需要从队列中间取出item
+    std::deque<Item> input_queue_;
     // std::mutex是C++中的一个线程安全的互斥量, 用于实现线程之间的互斥访问，保护共享资源，防止多个线程同时访问和修改这些资源，避免数据竞争和不一致的结果
     // queue_lock_用作一个互斥量,用于保护对input_queue_变量的访问
     // 通过调用queue_lock_.lock()可锁定互斥量，防止其他线程进入临界区；通过调用queue_lock_.unlock()解锁互斥量，允许其他线程进入临界区
@@ -51,6 +145,36 @@ namespace cpm
     volatile int max_items_processed_ = 0;
     // stream是一个指向void的指针，初始化为nullptr
     void *stream_ = nullptr;
+    // 分桶的key提取函数，例如输入的shape，为空时不分桶
+    std::function<uint64_t(const Input &)> bucket_key_;
+    // 去重的key提取函数，例如内容哈希(yolo::cpu::content_hash)，为空时不去重
+    std::function<uint64_t(const Input &)> dedup_key_;
+    // 队列中或正在推理的item，相同key的提交共享同一个future
+    std::unordered_map<uint64_t, InFlight> in_flight_;
+    // 最近完成的结果，容量为0时不缓存
+    lru::Cache<uint64_t, Result> recent_{0};
+    // 邮箱模式，每个流在队列中最多保留一个未处理的item(最新的输入)
+    bool mailbox_ = false;
+    uint64_t superseded_ = 0;
+    // 按流id有序，加权差额轮询从last_stream_之后的流开始，
+    // resume_为true时上一个batch在last_stream_的轮次中填满，下一个batch从该流继续
+    std::map<int, StreamState> streams_;
+    bool fair_ = false;
+    int last_stream_ = -1;
+    bool resume_ = false;
+    // 提交和完成的时间，为空时是steady_clock::now()
+    std::function<std::chrono::steady_clock::time_point()> clock_;
+    // 顺序交付，sequence_lock_保护delivery_、sequences_和交付的状态。
+    // 提交时在持有queue_lock_的同时获取sequence_lock_分配序号，持有sequence_lock_时不获取queue_lock_
+    std::mutex sequence_lock_;
+    std::function<void(int, uint64_t, const std::shared_future<Result> &)> delivery_;
+    std::map<int, Sequence> sequences_;
+    size_t window_ = 64;
+    // 同一时刻只有一个线程在回调(delivering_)，其他线程只设置redeliver_，由它再检查一遍，
+    // 回调时不持有任何锁，ready_只由正在交付的线程使用
+    bool delivering_ = false;
+    bool redeliver_ = false;
+    std::vector<Delivery> ready_;
 
   public:
     virtual ~Instance() { stop(); }
@@ -76,11 +200,13 @@ namespace cpm
             // 通过调用 set_value() 方法，可以将一个 Result 类型的值设置给 std::promise 对象，以供其他地方使用 std::future 来获取这个值。
             item.pro->set_value(Result());
           // 从 input_queue_（输入队列）中移除队列的第一个元素
-          // pop() 是队列（或者称为先进先出队列）的一个成员函数，它的作用是将队列的第一个元素移除。
+          // pop_front() 是双端队列的一个成员函数，它的作用是将队列的第一个元素移除。
           // 目的是在 stop() 函数中清空输入队列，以确保在停止之前没有未处理的输入。
-          // 通过连续调用 pop() 方法，将队列中的元素一个一个地移除，直到队列为空。
-          input_queue_.pop();
+          // 通过连续调用 pop_front() 方法，将队列中的元素一个一个地移除，直到队列为空。
+          input_queue_.pop_front();
         }
+        in_flight_.clear();
+        recent_.clear();
       };
 
       if (worker_)
@@ -92,34 +218,130 @@ namespace cpm
         // reset() 方法会释放 worker_ 所持有的资源，并将其重置为空指针。这样可以清理和重置工作线程对象，以便在后续的代码中重新使用或销毁。
         worker_.reset();
       }
+      deliver(-1);
     }
 
-    virtual std::shared_future<Result> commit(const Input &input)
+    // 设置分桶的key提取函数，之后每个batch只包含key相同的输入(例如相同的输入shape)
+    // 各个桶之间按照最早提交的item轮转，不会有桶被饿死。传入空函数取消分桶
+    void set_bucket_key(const std::function<uint64_t(const Input &)> &bucket_key)
     {
-      Item item;
-      item.input = input;
-      item.pro.reset(new std::promise<Result>());
+      std::unique_lock<std::mutex> __lock_(queue_lock_);
+      bucket_key_ = bucket_key;
+    }
+
+    // 设置去重的key提取函数，key相同的输入视为同一个输入：
+    // 队列中或正在推理时再次提交，共享同一次预处理、推理和解码，结果分发给所有的future；
+    // 最近cache_capacity个完成的结果保存在LRU中，再次提交时直接返回。
+    // key在提交的线程中计算，不持有锁。应在commit之前设置，传入空函数取消去重
+    void set_dedup(const std::function<uint64_t(const Input &)> &dedup_key, size_t cache_capacity = 16)
+    {
+      std::unique_lock<std::mutex> __lock_(queue_lock_);
+      dedup_key_ = dedup_key;
+      in_flight_.clear();
+      recent_.clear();
+      recent_.set_capacity(dedup_key ? cache_capacity : 0);
+    }
+
+    // 设置邮箱模式(用于实时视频流)：同一个流的新输入替换该流在队列中尚未处理的item，
+    // 并保留该item在队列中的位置，被替换的future.get()抛出Superseded。
+    // 该item被其他提交去重共享时不替换，它留在队列中正常完成，该流只是不再占用它，新输入排到队尾。
+    // 这样每个流在队列中最多只有一帧，过载时延迟也只有大约一个帧间隔，batch由不同的流组成
+    void set_mailbox(bool mailbox)
+    {
+      std::unique_lock<std::mutex> __lock_(queue_lock_);
+      mailbox_ = mailbox;
+    }
+
+    // 邮箱模式下被替换的item数量
+    uint64_t superseded()
+    {
+      std::unique_lock<std::mutex> __lock_(queue_lock_);
+      return superseded_;
+    }
+
+    // 设置流的权重和目标帧率，之后batch按流的加权差额轮询(deficit round robin)组成：
+    // 每轮每个有输入的流获得weight的额度，额度每满1取出该流最早的一个输入，
+    // 因此队列积压时各个流得到的batch位置与weight成正比，高帧率的流不会挤占其他流。
+    // target_fps > 0时超过该帧率的提交直接丢弃(future.get()抛出Decimated)，0为不限制。
+    // 未设置的流权重为1，不限制帧率
+    void set_stream(int stream, float weight = 1, float target_fps = 0)
+    {
+      std::unique_lock<std::mutex> __lock_(queue_lock_);
+      StreamState &state = streams_[stream];
+      state.weight = std::max(weight, 0.01f);
+      state.target_fps = std::max(target_fps, 0.0f);
+      fair_ = true;
+    }
+
+    // 替换提交和完成时使用的时钟(默认steady_clock::now)，用于不依赖真实时间地检查target_fps的丢弃
+    // 和延迟统计。应在commit之前设置，传入空函数恢复
+    void set_clock(const std::function<std::chrono::steady_clock::time_point()> &clock)
+    {
+      std::unique_lock<std::mutex> __lock_(queue_lock_);
+      clock_ = clock;
+    }
+
+    StreamStats stream_stats(int stream)
+    {
+      std::unique_lock<std::mutex> __lock_(queue_lock_);
+      auto iter = streams_.find(stream);
+      return iter == streams_.end() ? StreamStats() : iter->second.stats;
+    }
+
+    // 设置顺序交付：每个流的结果按提交顺序回调delivery(stream, 序号, future)，
+    // future已经完成，被丢弃的输入(Superseded、Decimated)同样按顺序交付，get()时抛出异常。
+    // 去重命中、丢弃等提前完成的结果会等待同一个流更早的结果，最多保留window个，
+    // 超出时跳过最早的未完成结果。回调在提交或推理的线程中、释放锁之后按顺序执行，
+    // 同一时刻只有一个线程在回调，回调中可以commit，但不能抛出异常。传入空函数取消顺序交付
+    void set_sequencer(const std::function<void(int, uint64_t, const std::shared_future<Result> &)> &delivery,
+                       size_t window = 64)
+    {
+      std::unique_lock<std::mutex> __lock_(sequence_lock_);
+      delivery_ = delivery;
+      window_ = std::max(window, (size_t)1);
+      sequences_.clear();
+    }
+
+    SequencerStats sequencer_stats(int stream)
+    {
+      std::unique_lock<std::mutex> __lock_(sequence_lock_);
+      auto iter = sequences_.find(stream);
+      return iter == sequences_.end() ? SequencerStats() : iter->second.stats;
+    }
+
+    virtual std::shared_future<Result> commit(const Input &input) { return commit(input, -1); }
+
+    // stream为输入所属的流id(例如摄像头编号)，>= 0
+    virtual std::shared_future<Result> commit(const Input &input, int stream)
+    {
+      bool dedup = (bool)dedup_key_;
+      uint64_t key = dedup ? dedup_key_(input) : 0;
+      std::shared_future<Result> output;
       {
         std::unique_lock<std::mutex> __lock_(queue_lock_);
-        input_queue_.push(item);
+        output = enqueue(input, stream, dedup, key);
+        // 序号和入队在同一个临界区内分配，同一个流的序号与进入队列的顺序一致
+        if (stream >= 0)
+          sequence(stream, output);
       }
       cond_.notify_one();
-      return item.pro->get_future();
+      if (stream >= 0)
+        deliver(stream);
+      return output;
     }
 
     virtual std::vector<std::shared_future<Result>> commits(const std::vector<Input> &inputs)
     {
+      bool dedup = (bool)dedup_key_;
+      std::vector<uint64_t> keys(inputs.size(), 0);
+      for (int i = 0; dedup && i < (int)inputs.size(); ++i)
+        keys[i] = dedup_key_(inputs[i]);
+
       std::vector<std::shared_future<Result>> output;
       {
         std::unique_lock<std::mutex> __lock_(queue_lock_);
         for (int i = 0; i < (int)inputs.size(); ++i)
-        {
-          Item item;
-          item.input = inputs[i];
-          item.pro.reset(new std::promise<Result>());
-          output.emplace_back(item.pro->get_future());
-          input_queue_.push(item);
-        }
+          output.emplace_back(enqueue(inputs[i], -1, dedup, keys[i]));
       }
       cond_.notify_one();
       return output;
@@ -139,6 +361,243 @@ namespace cpm
     }
 
   private:
+    // 需持有queue_lock_。邮箱模式下先替换该流未处理的item(被共享时只放弃该流对它的占用)，
+    // dedup时先查最近的结果和正在处理的item，都没有时才加入队列(或放到被替换的item的位置)
+    std::shared_future<Result> enqueue(const Input &input, int stream, bool dedup, uint64_t key)
+    {
+      auto now = clock_ ? clock_() : std::chrono::steady_clock::now();
+      if (stream >= 0 && decimate(streams_[stream], now))
+      {
+        std::promise<Result> pro;
+        pro.set_exception(std::make_exception_ptr(Decimated()));
+        return pro.get_future();
+      }
+
+      auto pending = input_queue_.end();
+      if (mailbox_ && stream >= 0)
+      {
+        pending = std::find_if(input_queue_.begin(), input_queue_.end(), [&](const Item &item)
+                               { return item.stream == stream; });
+        if (pending != input_queue_.end() && shared(*pending))
+        {
+          pending->stream = -1;
+          pending = input_queue_.end();
+        }
+        else if (pending != input_queue_.end())
+        {
+          supersede(*pending);
+        }
+      }
+
+      if (dedup)
+      {
+        Result *cached = recent_.get(key);
+        auto iter = in_flight_.find(key);
+        if (cached || iter != in_flight_.end())
+        {
+          if (pending != input_queue_.end())
+            input_queue_.erase(pending);
+
+          if (!cached)
+          {
+            iter->second.sharers++;
+            return iter->second.future;
+          }
+
+          std::promise<Result> pro;
+          pro.set_value(*cached);
+          return pro.get_future();
+        }
+      }
+
+      Item item;
+      item.input = input;
+      item.pro.reset(new std::promise<Result>());
+      item.dedup = dedup;
+      item.key = key;
+      item.stream = stream;
+      item.time = now;
+      if (bucket_key_)
+        item.bucket = bucket_key_(input);
+
+      std::shared_future<Result> output = item.pro->get_future();
+      if (dedup)
+      {
+        InFlight &flight = in_flight_[key];
+        flight.future = output;
+        flight.sharers = 0;
+      }
+      if (pending != input_queue_.end())
+        *pending = std::move(item);
+      else
+        input_queue_.push_back(item);
+      return output;
+    }
+
+    // 需持有queue_lock_。item的future是否还被其他的提交持有(去重命中)
+    bool shared(const Item &item)
+    {
+      if (!item.dedup)
+        return false;
+      auto iter = in_flight_.find(item.key);
+      return iter != in_flight_.end() && iter->second.sharers > 0;
+    }
+
+    // 需持有queue_lock_。只用于没有被共享的item，它的future只属于提交它的流
+    void supersede(Item &item)
+    {
+      if (item.dedup)
+        in_flight_.erase(item.key);
+      item.pro->set_exception(std::make_exception_ptr(Superseded()));
+      superseded_++;
+      if (item.stream >= 0)
+        streams_[item.stream].stats.superseded++;
+    }
+
+    // 需持有queue_lock_。记录提交的序号，之后由deliver交付
+    void sequence(int stream, const std::shared_future<Result> &future)
+    {
+      std::unique_lock<std::mutex> __lock_(sequence_lock_);
+      if (!delivery_)
+        return;
+
+      Sequence &seq = sequences_[stream];
+      SequenceEntry entry;
+      entry.sequence = seq.next++;
+      entry.future = future;
+      seq.entries.push_back(entry);
+    }
+
+    // 交付已经完成的结果(例如去重命中、被替换的输入或者推理完成的batch)，stream < 0时检查所有的流。
+    // 在sequence_lock_内取出按顺序可交付的结果，释放锁之后回调。其他线程正在回调时
+    // 只请求它再检查一遍，因此回调的顺序与序号一致
+    void deliver(int stream)
+    {
+      std::unique_lock<std::mutex> lock(sequence_lock_);
+      if (!delivery_)
+        return;
+      if (delivering_)
+      {
+        redeliver_ = true;
+        return;
+      }
+
+      delivering_ = true;
+      do
+      {
+        redeliver_ = false;
+        auto now = std::chrono::steady_clock::now();
+        for (auto &iter : sequences_)
+        {
+          if (stream < 0 || iter.first == stream)
+            deliver(iter.first, iter.second, now);
+        }
+        // 再检查时其他线程的流也可能有结果
+        stream = -1;
+
+        auto delivery = delivery_;
+        lock.unlock();
+        for (auto &item : ready_)
+        {
+          if (delivery)
+            delivery(item.stream, item.sequence, item.future);
+        }
+        ready_.clear();
+        lock.lock();
+      } while (redeliver_);
+      delivering_ = false;
+    }
+
+    // 需持有sequence_lock_。从最早的结果开始依次取出到ready_，遇到未完成的结果时停止，
+    // 除非等待的结果超过window_，此时跳过该结果
+    void deliver(int stream, Sequence &sequence, std::chrono::steady_clock::time_point now)
+    {
+      for (auto &entry : sequence.entries)
+      {
+        if (!entry.ready &&
+            entry.future.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+        {
+          entry.ready = true;
+          entry.ready_time = now;
+        }
+      }
+
+      SequencerStats &stats = sequence.stats;
+      while (!sequence.entries.empty())
+      {
+        SequenceEntry &entry = sequence.entries.front();
+        if (!entry.ready)
+        {
+          if (sequence.entries.size() <= window_)
+            break;
+
+          stats.skipped++;
+          sequence.entries.pop_front();
+          continue;
+        }
+
+        double hold = std::chrono::duration<double, std::milli>(now - entry.ready_time).count();
+        if (hold > 0)
+        {
+          stats.held++;
+          stats.hold_mean_ms += (hold - stats.hold_mean_ms) / stats.held;
+          stats.hold_max_ms = std::max(stats.hold_max_ms, hold);
+        }
+        stats.delivered++;
+        ready_.push_back({stream, entry.sequence, entry.future});
+        sequence.entries.pop_front();
+      }
+    }
+
+    // 需持有queue_lock_。记录提交，超过target_fps时返回true。
+    // 只在检查时允许提前半个帧间隔(抖动)，下一个时间从max(next_time, now)起算一个帧间隔，
+    // 因此接受的帧率不超过target_fps，即使连续的提交来自同一时刻
+    bool decimate(StreamState &state, std::chrono::steady_clock::time_point now)
+    {
+      state.stats.committed++;
+      if (state.target_fps <= 0)
+        return false;
+
+      auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(1.0 / state.target_fps));
+      if (now < state.next_time - period / 2)
+      {
+        state.stats.decimated++;
+        return true;
+      }
+      state.next_time = std::max(state.next_time, now) + period;
+      return false;
+    }
+
+    // 完成的item从in_flight_中移除，成功的结果放入recent_，推理失败(ret不足)的不缓存，
+    // 并统计各个流的延迟
+    template <typename Results>
+    void complete_items(const std::vector<Item> &fetch_items, const Results &ret)
+    {
+      std::unique_lock<std::mutex> __lock_(queue_lock_);
+      auto now = clock_ ? clock_() : std::chrono::steady_clock::now();
+      for (int i = 0; i < (int)fetch_items.size(); ++i)
+      {
+        const Item &item = fetch_items[i];
+        if (item.stream >= 0)
+        {
+          StreamStats &stats = streams_[item.stream].stats;
+          double latency = std::chrono::duration<double, std::milli>(now - item.time).count();
+          stats.completed++;
+          stats.latency_mean_ms += (latency - stats.latency_mean_ms) / stats.completed;
+          stats.latency_max_ms = std::max(stats.latency_max_ms, latency);
+          stats.latency_last_ms = latency;
+        }
+
+        if (!item.dedup)
+          continue;
+
+        in_flight_.erase(item.key);
+        if (i < (int)ret.size())
+          recent_.put(item.key, ret[i]);
+      }
+    }
+
     template <typename LoadMethod>
     void worker(const LoadMethod &loadmethod, std::promise<bool> &status)
     {
@@ -173,6 +632,8 @@ namespace cpm
             fetch_items[i].pro->set_value(Result());
           }
         }
+        complete_items(fetch_items, ret);
+        deliver(-1);
         inputs.clear();
         fetch_items.clear();
       }
@@ -190,14 +651,104 @@ namespace cpm
         return false;
 
       fetch_items.clear();
-      for (int i = 0; i < max_size && !input_queue_.empty(); ++i)
+      if (!bucket_key_ && !fair_)
+      {
+        for (int i = 0; i < max_size && !input_queue_.empty(); ++i)
+        {
+          fetch_items.emplace_back(std::move(input_queue_.front()));
+          input_queue_.pop_front();
+        }
+        return true;
+      }
+
+      // 取最早的item所在的桶(未分桶时都为0)，按提交顺序或者加权差额轮询选出该桶的item，
+      // 其他item保持原有顺序留在队列中
+      uint64_t bucket = input_queue_.front().bucket;
+      std::vector<char> taken(input_queue_.size(), 0);
+      if (fair_)
+      {
+        pick_fair(bucket, taken, max_size);
+      }
+      else
+      {
+        for (int i = 0, count = 0; i < (int)input_queue_.size() && count < max_size; ++i)
+        {
+          if (input_queue_[i].bucket == bucket)
+          {
+            taken[i] = 1;
+            count++;
+          }
+        }
+      }
+
+      auto keep = input_queue_.begin();
+      for (int i = 0; i < (int)taken.size(); ++i)
       {
-        fetch_items.emplace_back(std::move(input_queue_.front()));
-        input_queue_.pop();
+        auto iter = input_queue_.begin() + i;
+        if (taken[i])
+        {
+          fetch_items.emplace_back(std::move(*iter));
+          continue;
+        }
+
+        if (keep != iter)
+          *keep = std::move(*iter);
+        ++keep;
       }
+      input_queue_.erase(keep, input_queue_.end());
       return true;
     }
 
+    // 需持有queue_lock_。加权差额轮询：从上一个batch最后服务的流之后开始，依次给每个有输入的流
+    // 加上weight的额度，额度每满1按提交顺序取出该流的一个输入。输入取完的流额度清零。
+    // batch在某个流的轮次中填满(仍有额度和输入)时，下一个batch从该流继续用剩余的额度，不再加weight，
+    // 因此权重的比例与batch大小无关
+    void pick_fair(uint64_t bucket, std::vector<char> &taken, int max_size)
+    {
+      std::map<int, std::deque<int>> pending;
+      for (int i = 0; i < (int)input_queue_.size(); ++i)
+      {
+        if (input_queue_[i].bucket == bucket)
+          pending[input_queue_[i].stream].push_back(i);
+      }
+
+      int count = 0;
+      while (count < max_size && !pending.empty())
+      {
+        auto iter = resume_ ? pending.find(last_stream_) : pending.end();
+        bool resumed = iter != pending.end();
+        resume_ = false;
+        if (!resumed)
+        {
+          iter = pending.upper_bound(last_stream_);
+          if (iter == pending.end())
+            iter = pending.begin();
+        }
+
+        StreamState &state = streams_[iter->first];
+        if (!resumed)
+          state.deficit += state.weight;
+        while (state.deficit >= 1 && !iter->second.empty() && count < max_size)
+        {
+          taken[iter->second.front()] = 1;
+          iter->second.pop_front();
+          state.deficit -= 1;
+          count++;
+        }
+
+        last_stream_ = iter->first;
+        if (iter->second.empty())
+        {
+          state.deficit = 0;
+          pending.erase(iter);
+        }
+        else if (state.deficit >= 1)
+        {
+          resume_ = true;
+        }
+      }
+    }
+
     virtual bool get_item_and_wait(Item &fetch_item)
     {
       std::unique_lock<std::mutex> l(queue_lock_);
@@ -208,7 +759,7 @@ namespace cpm
         return false;
 
       fetch_item = std::move(input_queue_.front());
-      input_queue_.pop();
+      input_queue_.pop_front();
       return true;
     }
   };
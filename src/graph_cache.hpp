@@ -0,0 +1,96 @@
+#ifndef __GRAPH_CACHE_HPP__
+#define __GRAPH_CACHE_HPP__
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <memory>
+
+#include "lru.hpp"
+#include "yolo.hpp"
+
+// Which captured graph a batch replays. The keys, the replay or capture decision and the
+// invalidation live here without cuda, yolo.cu plugs in cuda graphs and the checks a stub.
+namespace graph {
+
+// The device side of one batch
+template <typename Graph>
+class Runner {
+ public:
+  virtual ~Runner() = default;
+  virtual bool eager() = 0;
+  // runs the batch once more inside the capture, nullptr when capturing failed
+  virtual std::shared_ptr<Graph> capture() = 0;
+  virtual void replay(const Graph &graph) = 0;
+};
+
+// batch size, pixel format and input resolution, packed as 14/2/24/24 bits
+inline uint64_t key(int batch, yolo::PixelFormat format, int width, int height) {
+  return ((uint64_t)batch << 50) | ((uint64_t)format << 48) |
+         ((uint64_t)(width & 0xFFFFFF) << 24) | (uint64_t)(height & 0xFFFFFF);
+}
+
+// Images of one resolution and format, none with its own options: the graphs hold the decode
+// parameters of the model
+inline bool capturable(const yolo::Image *images, int num_image) {
+  if (num_image <= 0) return false;
+  for (int i = 0; i < num_image; ++i) {
+    if (images[i].options) return false;
+    if (images[i].width != images[0].width || images[i].height != images[0].height ||
+        images[i].format != images[0].format)
+      return false;
+  }
+  return true;
+}
+
+// Graphs keyed by (batch, format, width, height), at most capacity of them (least recently used
+// evicted). A failed capture is remembered, that key keeps running eagerly. Not thread-safe.
+template <typename Graph>
+class Cache {
+ public:
+  // 0 disables the graphs
+  void set_capacity(int max_graphs) {
+    graphs_.clear();
+    graphs_.set_capacity(std::max(max_graphs, 0));
+  }
+
+  inline bool enabled() const { return graphs_.capacity() > 0; }
+  inline bool usable(const yolo::Image *images, int num_image) const {
+    return enabled() && capturable(images, num_image);
+  }
+  inline size_t size() const { return graphs_.size(); }
+
+  // captured graphs refer to the buffer addresses and hold the kernel arguments, clear when a
+  // setting changes or a buffer moved
+  void clear() { graphs_.clear(); }
+  void check_moved(const void *before, const void *after) {
+    if (before != after) graphs_.clear();
+  }
+
+  // replay the graph of this batch, capture it if this is the first time
+  bool run(const yolo::Image *images, int num_image, Runner<Graph> &runner) {
+    if (!usable(images, num_image)) return runner.eager();
+
+    uint64_t k = key(num_image, images[0].format, images[0].width, images[0].height);
+    std::shared_ptr<Graph> *cached = graphs_.get(k);
+    if (cached != nullptr) {
+      if (*cached == nullptr) return runner.eager();
+
+      runner.replay(**cached);
+      return true;
+    }
+
+    // TensorRT must have run once with the current shape before it can be captured
+    if (!runner.eager()) return false;
+
+    graphs_.put(k, runner.capture());
+    return true;
+  }
+
+ private:
+  lru::Cache<uint64_t, std::shared_ptr<Graph>> graphs_{0};
+};
+
+}  // namespace graph
+
+#endif  // __GRAPH_CACHE_HPP__
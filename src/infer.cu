@@ -199,6 +199,35 @@ void BaseMemory::release() {
   release_gpu();
 }
 
+class CudaHostAllocator : public HostAllocator {
+ public:
+  virtual void *allocate(size_t bytes) override {
+    void *ptr = nullptr;
+    if (cudaMallocHost(&ptr, bytes) != cudaSuccess) {
+      cudaGetLastError();
+      return nullptr;
+    }
+    return ptr;
+  }
+
+  virtual void release(void *ptr) override { checkRuntime(cudaFreeHost(ptr)); }
+
+  virtual bool register_memory(void *ptr, size_t bytes) override {
+    if (cudaHostRegister(ptr, bytes, cudaHostRegisterDefault) != cudaSuccess) {
+      cudaGetLastError();
+      return false;
+    }
+    return true;
+  }
+
+  virtual void unregister_memory(void *ptr) override { checkRuntime(cudaHostUnregister(ptr)); }
+};
+
+std::shared_ptr<HostAllocator> cuda_host_allocator() {
+  static shared_ptr<HostAllocator> allocator = make_shared<CudaHostAllocator>();
+  return allocator;
+}
+
 class __native_nvinfer_logger : public ILogger {
  public:
   virtual void log(Severity severity, const char *msg) noexcept override {
@@ -389,6 +418,20 @@ class InferImpl : public Infer {
     return false;
   }
 
+  virtual std::vector<int> profile_dims(const std::string &name, Profile which) override {
+    return profile_dims(index(name), which);
+  }
+
+  virtual std::vector<int> profile_dims(int ibinding, Profile which) override {
+    auto engine = this->context_->engine_;
+    if (!engine->bindingIsInput(ibinding) || engine->getNbOptimizationProfiles() == 0)
+      return static_dims(ibinding);
+
+    auto dim = engine->getProfileDimensions(ibinding, 0, (OptProfileSelector)which);
+    if (dim.nbDims < 0) return static_dims(ibinding);
+    return std::vector<int>(dim.d, dim.d + dim.nbDims);
+  }
+
   virtual void print() override {
     INFO("Infer %p [%s]", this, has_dynamic_dim() ? "DynamicShape" : "StaticShape");
 
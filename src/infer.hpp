@@ -13,6 +13,9 @@ void __log_func(const char *file, int line, const char *fmt, ...);
 
 enum class DType : int { FLOAT = 0, HALF = 1, INT8 = 2, INT32 = 3, BOOL = 4, UINT8 = 5 };
 
+// bounds of an optimization profile, as nvinfer1::OptProfileSelector
+enum class Profile : int { Min = 0, Opt = 1, Max = 2 };
+
 class Timer {
  public:
   Timer();
@@ -69,6 +72,40 @@ class Memory : public BaseMemory {
   virtual inline _DT *cpu() const { return (_DT *)cpu_; }
 };
 
+// Source of page-locked host memory for PinnedPool. The default one uses
+// cudaMallocHost/cudaHostRegister, a plain malloc one is enough to exercise the pool on the host.
+class HostAllocator {
+ public:
+  virtual ~HostAllocator() = default;
+  virtual void *allocate(size_t bytes) = 0;  // nullptr if failed
+  virtual void release(void *ptr) = 0;
+  virtual bool register_memory(void *ptr, size_t bytes) = 0;
+  virtual void unregister_memory(void *ptr) = 0;
+};
+
+// Recycles pinned host buffers and remembers which host ranges are page-locked, so that a copy
+// to device can be issued straight from them. Thread-safe.
+class PinnedPool {
+ public:
+  virtual ~PinnedPool() = default;
+
+  // The buffer returns to the pool when the last reference is released, even after the pool
+  // itself is gone (then it is freed).
+  virtual std::shared_ptr<unsigned char> lease(size_t bytes) = 0;
+  virtual bool register_memory(void *ptr, size_t bytes) = 0;
+  virtual void unregister_memory(void *ptr) = 0;
+
+  // [ptr, ptr + bytes) lies inside a leased or registered range
+  virtual bool is_pinned(const void *ptr, size_t bytes) = 0;
+  virtual size_t num_free() = 0;
+  virtual size_t cached_bytes() = 0;
+};
+
+std::shared_ptr<HostAllocator> cuda_host_allocator();
+std::shared_ptr<PinnedPool> create_pinned_pool(
+    std::shared_ptr<HostAllocator> allocator = cuda_host_allocator(),
+    size_t max_cached_bytes = 512 * 1024 * 1024);
+
 class Infer {
  public:
   virtual bool forward(const std::vector<void *> &bindings, void *stream = nullptr,
@@ -87,6 +124,10 @@ class Infer {
   virtual DType dtype(const std::string &name) = 0;
   virtual DType dtype(int ibinding) = 0;
   virtual bool has_dynamic_dim() = 0;
+
+  // dims of an input binding in optimization profile 0, the static dims when it has no profile
+  virtual std::vector<int> profile_dims(const std::string &name, Profile which) = 0;
+  virtual std::vector<int> profile_dims(int ibinding, Profile which) = 0;
   virtual void print() = 0;
 };
 
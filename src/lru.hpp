@@ -0,0 +1,79 @@
+#ifndef __LRU_HPP__
+#define __LRU_HPP__
+
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <utility>
+
+namespace lru {
+
+// Least-recently-used cache. get() refreshes the entry, put() evicts the oldest one when full.
+// Not thread-safe, the owner is expected to guard it.
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class Cache {
+ public:
+  explicit Cache(size_t capacity = 8) : capacity_(capacity) {}
+
+  Value *get(const Key &key) {
+    auto iter = index_.find(key);
+    if (iter == index_.end()) return nullptr;
+
+    items_.splice(items_.begin(), items_, iter->second);
+    return &iter->second->second;
+  }
+
+  Value *put(const Key &key, const Value &value) {
+    auto iter = index_.find(key);
+    if (iter != index_.end()) {
+      iter->second->second = value;
+      items_.splice(items_.begin(), items_, iter->second);
+      return &iter->second->second;
+    }
+
+    if (capacity_ == 0) return nullptr;
+    while (items_.size() >= capacity_) evict();
+
+    items_.emplace_front(key, value);
+    index_[key] = items_.begin();
+    return &items_.front().second;
+  }
+
+  bool erase(const Key &key) {
+    auto iter = index_.find(key);
+    if (iter == index_.end()) return false;
+
+    items_.erase(iter->second);
+    index_.erase(iter);
+    return true;
+  }
+
+  void set_capacity(size_t capacity) {
+    capacity_ = capacity;
+    while (items_.size() > capacity_) evict();
+  }
+
+  void clear() {
+    index_.clear();
+    items_.clear();
+  }
+
+  inline size_t size() const { return items_.size(); }
+  inline size_t capacity() const { return capacity_; }
+  inline bool empty() const { return items_.empty(); }
+
+ private:
+  void evict() {
+    index_.erase(items_.back().first);
+    items_.pop_back();
+  }
+
+  typedef std::list<std::pair<Key, Value>> ItemList;
+  size_t capacity_;
+  ItemList items_;
+  std::unordered_map<Key, typename ItemList::iterator, Hash> index_;
+};
+
+}  // namespace lru
+
+#endif  // __LRU_HPP__
@@ -1,8 +1,10 @@
 
+#include <chrono>
 #include <opencv2/opencv.hpp>
 
 #include "cpm.hpp"
 #include "infer.hpp"
+#include "mosaic.hpp"
 #include "yolo.hpp"
 
 using namespace std;
@@ -35,7 +37,9 @@ static const char *cocolabels[] = {"person",        "bicycle",      "car",
                                    "vase",          "scissors",     "teddy bear",
                                    "hair drier",    "toothbrush"};
 
-yolo::Image cvimg(const cv::Mat &image) { return yolo::Image(image.data, image.cols, image.rows); }
+yolo::Image cvimg(const cv::Mat &image) {
+  return yolo::Image(image.data, image.cols, image.rows, image.step);
+}
 
 void perf() {
   int max_infer_batch = 16;
@@ -46,8 +50,13 @@ void perf() {
   for (int i = images.size(); i < batch; ++i) images.push_back(images[i % 3]);
 
   cpm::Instance<yolo::BoxArray, yolo::Image, yolo::Infer> cpmi;
-  bool ok = cpmi.start([] { return yolo::load("yolov8n.transd.engine", yolo::Type::V8); },
-                       max_infer_batch);
+  bool ok = cpmi.start(
+      [=] {
+        auto model = yolo::load("yolov8n.transd.engine", yolo::Type::V8);
+        if (model != nullptr) model->warmup(max_infer_batch);
+        return model;
+      },
+      max_infer_batch);
 
   if (!ok) return;
 
@@ -68,6 +77,160 @@ void perf() {
   }
 }
 
+// The preprocess before the templates, as a host loop: the per pixel code of the old
+// warp_affine_bilinear_and_normalize_plane_kernel, branching on the norm and the channel order
+// and dividing by std. The baseline of preprocess_perf.
+static void legacy_preprocess(const cv::Mat &image, float *dst, int dst_width, int dst_height,
+                              uint8_t const_value_st, const float *m, const yolo::Norm &norm) {
+  const uint8_t *src = image.data;
+  int src_line_size = image.step, src_width = image.cols, src_height = image.rows;
+#pragma omp parallel for
+  for (int dy = 0; dy < dst_height; ++dy) {
+    for (int dx = 0; dx < dst_width; ++dx) {
+      float src_x = m[0] * dx + m[1] * dy + m[2];
+      float src_y = m[3] * dx + m[4] * dy + m[5];
+      float c0, c1, c2;
+      if (src_x <= -1 || src_x >= src_width || src_y <= -1 || src_y >= src_height) {
+        c0 = c1 = c2 = const_value_st;
+      } else {
+        int y_low = floorf(src_y);
+        int x_low = floorf(src_x);
+        int y_high = y_low + 1;
+        int x_high = x_low + 1;
+
+        uint8_t const_value[] = {const_value_st, const_value_st, const_value_st};
+        float ly = src_y - y_low;
+        float lx = src_x - x_low;
+        float hy = 1 - ly;
+        float hx = 1 - lx;
+        float w1 = hy * hx, w2 = hy * lx, w3 = ly * hx, w4 = ly * lx;
+        const uint8_t *v1 = const_value, *v2 = const_value, *v3 = const_value,
+                      *v4 = const_value;
+        if (y_low >= 0) {
+          if (x_low >= 0) v1 = src + y_low * src_line_size + x_low * 3;
+          if (x_high < src_width) v2 = src + y_low * src_line_size + x_high * 3;
+        }
+        if (y_high < src_height) {
+          if (x_low >= 0) v3 = src + y_high * src_line_size + x_low * 3;
+          if (x_high < src_width) v4 = src + y_high * src_line_size + x_high * 3;
+        }
+        c0 = floorf(w1 * v1[0] + w2 * v2[0] + w3 * v3[0] + w4 * v4[0] + 0.5f);
+        c1 = floorf(w1 * v1[1] + w2 * v2[1] + w3 * v3[1] + w4 * v4[1] + 0.5f);
+        c2 = floorf(w1 * v1[2] + w2 * v2[2] + w3 * v3[2] + w4 * v4[2] + 0.5f);
+      }
+
+      if (norm.channel_type == yolo::ChannelType::SwapRB) std::swap(c0, c2);
+
+      if (norm.type == yolo::NormType::MeanStd) {
+        c0 = (c0 * norm.alpha - norm.mean[0]) / norm.std[0];
+        c1 = (c1 * norm.alpha - norm.mean[1]) / norm.std[1];
+        c2 = (c2 * norm.alpha - norm.mean[2]) / norm.std[2];
+      } else if (norm.type == yolo::NormType::AlphaBeta) {
+        c0 = c0 * norm.alpha + norm.beta;
+        c1 = c1 * norm.alpha + norm.beta;
+        c2 = c2 * norm.alpha + norm.beta;
+      }
+
+      int area = dst_width * dst_height;
+      float *pdst = dst + dy * dst_width + dx;
+      pdst[0] = c0;
+      pdst[area] = c1;
+      pdst[area * 2] = c2;
+    }
+  }
+}
+
+// per frame time of the old runtime-branch preprocess against the template instantiation, both
+// on the cpu, for the two norms
+void preprocess_perf() {
+  cv::Mat image = cv::imread("inference/car.jpg");
+  yolo::AffineMatrix affine;
+  affine.compute(make_tuple(image.cols, image.rows), make_tuple(640, 640));
+
+  const float mean[] = {0.485f, 0.456f, 0.406f}, std[] = {0.229f, 0.224f, 0.225f};
+  yolo::Norm norms[] = {yolo::Norm::alpha_beta(1 / 255.0f, 0.0f, yolo::ChannelType::SwapRB),
+                        yolo::Norm::mean_std(mean, std, 1 / 255.0f, yolo::ChannelType::SwapRB)};
+  const char *names[] = {"AlphaBeta", "MeanStd"};
+  std::vector<float> input(3 * 640 * 640);
+  int ntest = 20;
+  for (int k = 0; k < 2; ++k) {
+    auto begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < ntest; ++i)
+      legacy_preprocess(image, input.data(), 640, 640, 114, affine.d2i, norms[k]);
+    auto end = std::chrono::steady_clock::now();
+    float legacy_ms = std::chrono::duration<float, std::milli>(end - begin).count() / ntest;
+
+    begin = std::chrono::steady_clock::now();
+    for (int i = 0; i < ntest; ++i) {
+      yolo::cpu::warp_affine_bilinear_and_normalize_plane(cvimg(image), input.data(), 640, 640,
+                                                          affine.d2i, 114, norms[k]);
+    }
+    end = std::chrono::steady_clock::now();
+    float ms = std::chrono::duration<float, std::milli>(end - begin).count() / ntest;
+    printf("[CPU Preprocess %s %dx%d -> 640x640]: runtime branches %.5f ms, template %.5f ms, "
+           "%.2fx\n",
+           names[k], image.cols, image.rows, legacy_ms, ms, legacy_ms / ms);
+  }
+
+  // opencv baseline, warpAffine + the planar float conversion of cv::dnn::blobFromImage
+  cv::Mat i2d(2, 3, CV_32F, affine.i2d), letterbox, rgb, scaled;
+  std::vector<float> baseline(3 * 640 * 640);
+  auto begin = std::chrono::steady_clock::now();
+  for (int i = 0; i < ntest; ++i) {
+    cv::warpAffine(image, letterbox, i2d, cv::Size(640, 640), cv::INTER_LINEAR,
+                   cv::BORDER_CONSTANT, cv::Scalar::all(114));
+    cv::cvtColor(letterbox, rgb, cv::COLOR_BGR2RGB);
+    rgb.convertTo(scaled, CV_32F, 1 / 255.0f);
+    std::vector<cv::Mat> planes{cv::Mat(640, 640, CV_32F, baseline.data()),
+                                cv::Mat(640, 640, CV_32F, baseline.data() + 640 * 640),
+                                cv::Mat(640, 640, CV_32F, baseline.data() + 640 * 640 * 2)};
+    cv::split(scaled, planes);
+  }
+  auto end = std::chrono::steady_clock::now();
+  float ms = std::chrono::duration<float, std::milli>(end - begin).count() / ntest;
+  printf("[OpenCV Preprocess %dx%d -> 640x640]: %.5f ms\n", image.cols, image.rows, ms);
+}
+
+// 64 thumbnails of 200x200: letterboxed one per input vs packed into shared canvases
+void mosaic_perf() {
+  int max_infer_batch = 16;
+  auto yolo = yolo::load("yolov8n.transd.engine", yolo::Type::V8);
+  if (yolo == nullptr) return;
+  yolo->warmup(max_infer_batch);
+
+  std::vector<cv::Mat> sources{cv::imread("inference/car.jpg"), cv::imread("inference/gril.jpg"),
+                               cv::imread("inference/group.jpg")};
+  std::vector<cv::Mat> thumbnails(64);
+  std::vector<yolo::Image> yoloimages(thumbnails.size());
+  for (int i = 0; i < (int)thumbnails.size(); ++i) {
+    cv::resize(sources[i % sources.size()], thumbnails[i], cv::Size(200, 200));
+    yoloimages[i] = cvimg(thumbnails[i]);
+  }
+
+  int ntest = 10;
+  auto begin = std::chrono::steady_clock::now();
+  for (int t = 0; t < ntest; ++t) {
+    for (int first = 0; first < (int)yoloimages.size(); first += max_infer_batch) {
+      std::vector<yolo::Image> chunk(yoloimages.begin() + first,
+                                     yoloimages.begin() + first + max_infer_batch);
+      yolo->forwards(chunk);
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+  float ms = std::chrono::duration<float, std::milli>(end - begin).count() / ntest;
+  printf("[Letterbox %d thumbnails]: %.5f ms, %.1f images/s\n", (int)yoloimages.size(), ms,
+         yoloimages.size() * 1000 / ms);
+
+  mosaic::Config config;
+  config.max_batch = max_infer_batch;
+  begin = std::chrono::steady_clock::now();
+  for (int t = 0; t < ntest; ++t) mosaic::forward(yolo.get(), yoloimages, config);
+  end = std::chrono::steady_clock::now();
+  ms = std::chrono::duration<float, std::milli>(end - begin).count() / ntest;
+  printf("[Mosaic %d thumbnails]: %.5f ms, %.1f images/s\n", (int)yoloimages.size(), ms,
+         yoloimages.size() * 1000 / ms);
+}
+
 void batch_inference() {
   std::vector<cv::Mat> images{cv::imread("inference/car.jpg"), cv::imread("inference/gril.jpg"),
                               cv::imread("inference/group.jpg")};
@@ -131,7 +294,9 @@ void single_inference() {
 }
 
 int main() {
+  preprocess_perf();
   perf();
+  mosaic_perf();
   batch_inference();
   single_inference();
   return 0;
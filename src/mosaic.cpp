@@ -0,0 +1,181 @@
+#include "mosaic.hpp"
+
+#include <string.h>
+
+#include <algorithm>
+
+namespace mosaic {
+
+using namespace std;
+
+// image pixel centers to canvas pixel centers at (x, y) with scale, inverted as AffineMatrix
+static void make_affine(float scale, int x, int y, float i2d[6], float d2i[6]) {
+  i2d[0] = scale;
+  i2d[1] = 0;
+  i2d[2] = x + scale * 0.5 - 0.5;
+  i2d[3] = 0;
+  i2d[4] = scale;
+  i2d[5] = y + scale * 0.5 - 0.5;
+
+  double D = 1.0 / ((double)i2d[0] * i2d[4]);
+  double A11 = i2d[4] * D, A22 = i2d[0] * D;
+  d2i[0] = A11;
+  d2i[1] = 0;
+  d2i[2] = -A11 * i2d[2];
+  d2i[3] = 0;
+  d2i[4] = A22;
+  d2i[5] = -A22 * i2d[5];
+}
+
+vector<Placement> pack(const vector<tuple<int, int>> &sizes, const Config &config) {
+  int spacing = std::max(config.spacing, 0);
+  int room_width = config.canvas_width - 2 * spacing;
+  int room_height = config.canvas_height - 2 * spacing;
+  vector<Placement> placements(sizes.size());
+  if (room_width <= 0 || room_height <= 0) return {};
+
+  for (int i = 0; i < (int)sizes.size(); ++i) {
+    Placement &item = placements[i];
+    item.index = i;
+    item.source_width = std::max(std::get<0>(sizes[i]), 1);
+    item.source_height = std::max(std::get<1>(sizes[i]), 1);
+
+    float scale = std::min(std::min(room_width / (float)item.source_width,
+                                    room_height / (float)item.source_height),
+                           1.0f);
+    item.width = std::min(std::max((int)(item.source_width * scale + 0.5f), 1), room_width);
+    item.height = std::min(std::max((int)(item.source_height * scale + 0.5f), 1), room_height);
+    item.scale = scale;
+  }
+
+  vector<int> order(sizes.size());
+  for (int i = 0; i < (int)order.size(); ++i) order[i] = i;
+  std::stable_sort(order.begin(), order.end(),
+                   [&](int a, int b) { return placements[a].height > placements[b].height; });
+
+  int canvas = 0, x = spacing, y = spacing, shelf_height = 0;
+  for (int i : order) {
+    Placement &item = placements[i];
+    if (x + item.width + spacing > config.canvas_width) {
+      x = spacing;
+      y += shelf_height + spacing;
+      shelf_height = 0;
+    }
+    if (y + item.height + spacing > config.canvas_height) {
+      canvas++;
+      x = spacing;
+      y = spacing;
+      shelf_height = 0;
+    }
+
+    item.canvas = canvas;
+    item.x = x;
+    item.y = y;
+    make_affine(item.scale, x, y, item.i2d, item.d2i);
+    x += item.width + spacing;
+    shelf_height = std::max(shelf_height, item.height);
+  }
+  return placements;
+}
+
+int num_canvases(const vector<Placement> &placements) {
+  int count = 0;
+  for (auto &item : placements) count = std::max(count, item.canvas + 1);
+  return count;
+}
+
+void render(const vector<yolo::Image> &images, const vector<Placement> &placements,
+            const Config &config, vector<vector<uint8_t>> &canvases) {
+  size_t canvas_bytes = (size_t)config.canvas_width * config.canvas_height * 3;
+  canvases.resize(num_canvases(placements));
+  for (auto &canvas : canvases) canvas.assign(canvas_bytes, config.fill);
+
+  vector<uint8_t> region;
+  for (auto &item : placements) {
+    // the affine of the region alone, its origin at (0, 0)
+    float i2d[6], d2i[6];
+    make_affine(item.scale, 0, 0, i2d, d2i);
+    region.resize((size_t)item.width * item.height * 3);
+    yolo::cpu::warp_affine_nhwc(images[item.index], region.data(), item.width, item.height, d2i,
+                                config.fill, yolo::ChannelType::None, config.interp);
+
+    uint8_t *dst = canvases[item.canvas].data();
+    for (int row = 0; row < item.height; ++row) {
+      memcpy(dst + ((size_t)(item.y + row) * config.canvas_width + item.x) * 3,
+             region.data() + (size_t)row * item.width * 3, (size_t)item.width * 3);
+    }
+  }
+}
+
+vector<yolo::BoxArray> unpack(const vector<yolo::BoxArray> &canvas_boxes,
+                              const vector<Placement> &placements, int num_images) {
+  vector<yolo::BoxArray> output(num_images);
+  for (auto &item : placements) {
+    if (item.canvas >= (int)canvas_boxes.size() || item.index >= num_images) continue;
+
+    for (auto &box : canvas_boxes[item.canvas]) {
+      float cx = (box.left + box.right) * 0.5f;
+      float cy = (box.top + box.bottom) * 0.5f;
+      if (cx < item.x || cx >= item.x + item.width || cy < item.y || cy >= item.y + item.height)
+        continue;
+
+      const float *d2i = item.d2i;
+      yolo::Box mapped = box;
+      mapped.left = std::max(d2i[0] * box.left + d2i[2], 0.0f);
+      mapped.top = std::max(d2i[4] * box.top + d2i[5], 0.0f);
+      mapped.right = std::min(d2i[0] * box.right + d2i[2], (float)item.source_width);
+      mapped.bottom = std::min(d2i[4] * box.bottom + d2i[5], (float)item.source_height);
+      output[item.index].emplace_back(std::move(mapped));
+    }
+  }
+  return output;
+}
+
+vector<yolo::BoxArray> forward(const Forwards &forwards, const vector<yolo::Image> &images,
+                               const Config &config) {
+  vector<tuple<int, int>> sizes(images.size());
+  for (size_t i = 0; i < images.size(); ++i)
+    sizes[i] = make_tuple(images[i].width, images[i].height);
+
+  vector<Placement> placements = pack(sizes, config);
+  if (placements.size() != images.size()) return {};
+
+  vector<vector<uint8_t>> canvases;
+  render(images, placements, config, canvases);
+
+  // no box can pass an iou above 1, the nms runs per image below. Per image options keep the
+  // canvases off the cuda graphs.
+  auto no_nms = make_shared<yolo::ImageOptions>();
+  no_nms->nms_threshold = 1.0f;
+
+  size_t max_batch = std::max(config.max_batch, 1);
+  vector<yolo::BoxArray> canvas_boxes;
+  canvas_boxes.reserve(canvases.size());
+  vector<yolo::Image> chunk;
+  for (size_t first = 0; first < canvases.size(); first += max_batch) {
+    chunk.clear();
+    for (size_t i = first; i < canvases.size() && i < first + max_batch; ++i) {
+      chunk.emplace_back(canvases[i].data(), config.canvas_width, config.canvas_height);
+      chunk.back().options = no_nms;
+    }
+
+    vector<yolo::BoxArray> result = forwards(chunk);
+    if (result.size() != chunk.size()) return {};
+
+    for (auto &boxes : result) canvas_boxes.emplace_back(std::move(boxes));
+  }
+  vector<yolo::BoxArray> output = unpack(canvas_boxes, placements, images.size());
+  for (auto &boxes : output)
+    boxes = yolo::cpu::nms(boxes, config.nms_threshold, config.class_agnostic);
+  return output;
+}
+
+vector<yolo::BoxArray> forward(yolo::Infer *model, const vector<yolo::Image> &images,
+                               const Config &config, void *stream) {
+  auto forwards = [&](const vector<yolo::Image> &chunk) {
+    return model->forwards(chunk, stream);
+  };
+  return forward(forwards, images, config);
+}
+
+};  // namespace mosaic
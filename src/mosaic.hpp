@@ -0,0 +1,75 @@
+#ifndef __MOSAIC_HPP__
+#define __MOSAIC_HPP__
+
+#include <stdint.h>
+
+#include <functional>
+#include <tuple>
+#include <vector>
+
+#include "yolo.hpp"
+
+// Mosaic packing: many small images are placed side by side into canvases of the network input
+// size, so a forward is not mostly letterbox padding. Each image keeps its own affine (as
+// AffineMatrix), the boxes of a canvas go back to the image whose region holds their center.
+// The canvases run without nms, it is applied per image after unpacking, so that a box of one
+// image never suppresses a box of its neighbour. Packing, drawing and unpacking run on the host.
+namespace mosaic {
+
+struct Config {
+  int canvas_width = 640, canvas_height = 640;  // the network input
+  int spacing = 8;     // pixels of fill between the images, keeps their objects apart
+  uint8_t fill = 114;  // value of the unused pixels, as the letterbox
+  yolo::Interp interp = yolo::Interp::Bilinear;
+  int max_batch = 16;  // canvases per forwards call
+  float nms_threshold = 0.5f;  // of the nms per image
+  bool class_agnostic = false;
+};
+
+// where image index is drawn
+struct Placement {
+  int index = 0;                            // of the source image
+  int canvas = 0;                           // of the canvas
+  int x = 0, y = 0, width = 0, height = 0;  // region in the canvas
+  int source_width = 0, source_height = 0;
+  float scale = 1;  // canvas pixels per image pixel
+  float i2d[6];     // image to canvas
+  float d2i[6];     // canvas to image
+};
+
+typedef std::function<std::vector<yolo::BoxArray>(const std::vector<yolo::Image> &)> Forwards;
+
+// Shelf packer: the images, tallest first, fill rows left to right, a new row starts below the
+// tallest of the last one and a new canvas when the rows are full. Images are drawn at their own
+// size, larger ones shrink to fit one canvas.
+std::vector<Placement> pack(const std::vector<std::tuple<int, int>> &sizes,
+                            const Config &config);
+
+// number of canvases used by placements
+int num_canvases(const std::vector<Placement> &placements);
+
+// Draws every placement into its canvas, packed bgr of canvas_width x canvas_height. canvases
+// is resized to num_canvases(placements).
+void render(const std::vector<yolo::Image> &images, const std::vector<Placement> &placements,
+            const Config &config, std::vector<std::vector<uint8_t>> &canvases);
+
+// Boxes of each canvas back to their source images: the placement holding the center of a box
+// takes it, mapped through its d2i and clipped to the image. Segmentation masks keep the canvas
+// resolution.
+std::vector<yolo::BoxArray> unpack(const std::vector<yolo::BoxArray> &canvas_boxes,
+                                   const std::vector<Placement> &placements, int num_images);
+
+// pack, render, forwards in chunks of max_batch canvases with the nms of the model disabled,
+// unpack and nms per image. The options of the images are not applied, the canvases run with the
+// confidence threshold of the model. Empty if a forwards call failed.
+// The nms is disabled through per image options (nms_threshold = 1) on every canvas, and images
+// with options never replay a cuda graph: with set_cuda_graph(true) the canvases still run
+// eagerly.
+std::vector<yolo::BoxArray> forward(const Forwards &forwards,
+                                    const std::vector<yolo::Image> &images, const Config &config);
+std::vector<yolo::BoxArray> forward(yolo::Infer *model, const std::vector<yolo::Image> &images,
+                                    const Config &config, void *stream = nullptr);
+
+};  // namespace mosaic
+
+#endif  // __MOSAIC_HPP__
@@ -0,0 +1,107 @@
+#include "motion.hpp"
+
+#include <algorithm>
+#include <chrono>
+
+#include "yolo_kernel.hpp"
+
+namespace motion {
+
+using namespace std;
+
+// pixel centers of count samples spread evenly over size pixels
+static void sample_positions(int size, int count, vector<int> &positions) {
+  positions.resize(count);
+  for (int i = 0; i < count; ++i)
+    positions[i] = std::min((int)((i + 0.5f) * size / count), size - 1);
+}
+
+// luma of pixel (x, y): the Y byte of the yuv formats, BT.601 weights for bgr
+static inline int luma(const yolo::PlaneView &view, int x, int y) {
+  const uint8_t *row = view.data[0] + (size_t)y * view.line_size[0];
+  if (view.format == yolo::PixelFormat::BGR) {
+    const uint8_t *p = row + x * 3;
+    return (29 * p[0] + 150 * p[1] + 77 * p[2] + 128) >> 8;
+  }
+  return view.format == yolo::PixelFormat::YUYV ? row[x * 2] : row[x];
+}
+
+bool Gate::need_forward(const yolo::Image &image) {
+  frames_++;
+  int grid_width = std::max(config_.grid_width, 1);
+  int grid_height = std::max(config_.grid_height, 1);
+  int samples = std::max(config_.samples, 1);
+
+  // a new size is always forwarded, so the positions only change with width_ and height_
+  if (image.width != width_ || image.height != height_ ||
+      columns_.size() != (size_t)grid_width * samples ||
+      rows_.size() != (size_t)grid_height * samples) {
+    sample_positions(image.width, grid_width * samples, columns_);
+    sample_positions(image.height, grid_height * samples, rows_);
+  }
+
+  yolo::PlaneView view = yolo::plane_view(image);
+  int count = samples * samples;
+  grid_.resize((size_t)grid_width * grid_height);
+  for (int gy = 0; gy < grid_height; ++gy) {
+    for (int gx = 0; gx < grid_width; ++gx) {
+      int sum = 0;
+      for (int sy = 0; sy < samples; ++sy) {
+        int y = rows_[gy * samples + sy];
+        for (int sx = 0; sx < samples; ++sx) sum += luma(view, columns_[gx * samples + sx], y);
+      }
+      grid_[gy * grid_width + gx] = (sum + count / 2) / count;
+    }
+  }
+
+  bool forward = reference_.size() != grid_.size() || image.width != width_ ||
+                 image.height != height_ || image.format != format_;
+  if (!forward) {
+    size_t changed = yolo::cpu::count_differences(grid_.data(), reference_.data(), grid_.size(),
+                                                  config_.cell_threshold);
+    last_change_ = changed / (float)grid_.size();
+    forward = last_change_ > config_.threshold ||
+              (config_.refresh_interval > 0 && since_forward_ + 1 >= config_.refresh_interval);
+  } else {
+    last_change_ = 1;
+  }
+
+  if (!forward) {
+    since_forward_++;
+    skipped_++;
+    return false;
+  }
+
+  reference_.swap(grid_);
+  width_ = image.width;
+  height_ = image.height;
+  format_ = image.format;
+  since_forward_ = 0;
+  return true;
+}
+
+bool Gate::retry_failed() {
+  if (!last_.valid() || last_.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+    return false;
+
+  try {
+    last_.get();
+    return false;
+  } catch (...) {
+  }
+
+  // undo the skip of need_forward, grid_ still holds this frame
+  skipped_--;
+  since_forward_ = 0;
+  reference_.swap(grid_);
+  return true;
+}
+
+void Gate::reset() {
+  reference_.clear();
+  width_ = height_ = 0;
+  since_forward_ = 0;
+  last_ = std::shared_future<yolo::BoxArray>();
+}
+
+};  // namespace motion
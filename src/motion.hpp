@@ -0,0 +1,77 @@
+#ifndef __MOTION_HPP__
+#define __MOTION_HPP__
+
+#include <stdint.h>
+
+#include <future>
+#include <vector>
+
+#include "yolo.hpp"
+
+// Motion gate for static cameras: each frame is reduced to a small luma grid and compared with the
+// grid of the last forwarded frame. Below the change threshold the forward is skipped and the
+// result of that frame is reused, a forward is still forced every refresh_interval frames. A grid
+// value is the mean luma of samples x samples pixels spread over its cell, so a 1080p frame costs
+// some 37k reads with the defaults instead of a pass over every pixel. One gate per stream, it is
+// not thread-safe.
+namespace motion {
+
+struct Config {
+  int grid_width = 64, grid_height = 36;  // the thumbnail compared between frames
+  int samples = 4;                        // pixels read per cell along each axis, 1 = nearest
+  uint8_t cell_threshold = 16;            // difference of one grid value counted as a change
+  float threshold = 0.01f;                // changed fraction of the grid that needs a forward
+  int refresh_interval = 30;              // forced forward every this many frames, 0 = never
+};
+
+class Gate {
+ public:
+  explicit Gate(const Config &config = Config()) : config_(config) {}
+
+  // True when image has to be forwarded: the first frame, a new size or format, more than
+  // threshold of the grid changed since the last forwarded frame or refresh_interval frames
+  // skipped. The grid of image becomes the reference when true.
+  bool need_forward(const yolo::Image &image);
+
+  // commit of cpm::Instance behind the gate, on stream (see set_stream, -1 = none): a skipped
+  // frame gets the future of the last forwarded one, so the previous BoxArray, without entering
+  // the queue. Skipped frames are not committed, the stream's decimation, stats and sequencer only
+  // see the forwarded ones.
+  // A failed result is never handed on: when the stored future is ready with an exception
+  // (Superseded, Decimated, a failed inference) the frame is committed instead of skipped and
+  // becomes the reference. A future still pending is returned as it is.
+  template <typename Instance>
+  std::shared_future<yolo::BoxArray> commit(Instance &instance, const yolo::Image &image,
+                                            int stream = -1) {
+    bool forward = need_forward(image) || retry_failed();
+    if (forward || !last_.valid()) last_ = instance.commit(image, stream);
+    return last_;
+  }
+
+  // forgets the reference, the next frame is forwarded
+  void reset();
+
+  inline uint64_t frames() const { return frames_; }
+  inline uint64_t skipped() const { return skipped_; }
+  inline float skip_ratio() const { return frames_ ? skipped_ / (float)frames_ : 0.0f; }
+  // fraction of the grid changed at the last need_forward, to tune threshold
+  inline float last_change() const { return last_change_; }
+
+ private:
+  Config config_;
+  std::vector<uint8_t> reference_, grid_;
+  std::vector<int> columns_, rows_;  // sampled pixel x and y, samples per cell
+  int width_ = 0, height_ = 0;
+  yolo::PixelFormat format_ = yolo::PixelFormat::BGR;
+  int since_forward_ = 0;
+  uint64_t frames_ = 0, skipped_ = 0;
+  float last_change_ = 0;
+  std::shared_future<yolo::BoxArray> last_;
+
+  // after a skip: true when last_ failed, the skipped frame is then forwarded
+  bool retry_failed();
+};
+
+};  // namespace motion
+
+#endif  // __MOTION_HPP__
@@ -0,0 +1,143 @@
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "infer.hpp"
+
+// PinnedPool on top of a HostAllocator. No cuda in here, the pool runs on the host with any
+// allocator (cuda_host_allocator() in infer.cu).
+
+namespace trt {
+
+using namespace std;
+
+class PinnedPoolImpl : public PinnedPool, public enable_shared_from_this<PinnedPoolImpl> {
+ public:
+  struct Range {
+    size_t bytes;
+    bool registered;
+  };
+
+  shared_ptr<HostAllocator> allocator_;
+  size_t max_cached_bytes_ = 0;
+  size_t cached_bytes_ = 0;
+  multimap<size_t, void *> free_;
+  map<uintptr_t, Range> ranges_;
+  mutex lock_;
+
+  PinnedPoolImpl(shared_ptr<HostAllocator> allocator, size_t max_cached_bytes)
+      : allocator_(allocator), max_cached_bytes_(max_cached_bytes) {}
+
+  virtual ~PinnedPoolImpl() {
+    for (auto &item : free_) allocator_->release(item.second);
+    for (auto &item : ranges_) {
+      if (item.second.registered) allocator_->unregister_memory((void *)item.first);
+    }
+  }
+
+  virtual shared_ptr<unsigned char> lease(size_t bytes) override {
+    if (bytes == 0) return nullptr;
+
+    void *ptr = nullptr;
+    size_t capacity = bytes;
+    {
+      unique_lock<mutex> l(lock_);
+      // reuse a free buffer unless it would waste more than half of it
+      auto iter = free_.lower_bound(bytes);
+      if (iter != free_.end() && iter->first / 2 <= bytes) {
+        capacity = iter->first;
+        ptr = iter->second;
+        cached_bytes_ -= capacity;
+        free_.erase(iter);
+      }
+    }
+
+    if (ptr == nullptr) {
+      ptr = allocator_->allocate(bytes);
+      if (ptr == nullptr) {
+        INFO("Failed to allocate %lld bytes pinned memory", (long long)bytes);
+        return nullptr;
+      }
+
+      unique_lock<mutex> l(lock_);
+      ranges_[(uintptr_t)ptr] = Range{bytes, false};
+    }
+
+    weak_ptr<PinnedPoolImpl> weak_pool = shared_from_this();
+    shared_ptr<HostAllocator> allocator = allocator_;
+    return shared_ptr<unsigned char>(
+        (unsigned char *)ptr, [weak_pool, allocator, capacity](unsigned char *p) {
+          auto pool = weak_pool.lock();
+          if (pool)
+            pool->recycle(p, capacity);
+          else
+            allocator->release(p);
+        });
+  }
+
+  void recycle(void *ptr, size_t capacity) {
+    {
+      unique_lock<mutex> l(lock_);
+      if (cached_bytes_ + capacity <= max_cached_bytes_) {
+        free_.insert(make_pair(capacity, ptr));
+        cached_bytes_ += capacity;
+        return;
+      }
+      ranges_.erase((uintptr_t)ptr);
+    }
+    allocator_->release(ptr);
+  }
+
+  virtual bool register_memory(void *ptr, size_t bytes) override {
+    if (ptr == nullptr || bytes == 0) return false;
+    if (is_pinned(ptr, bytes)) return true;
+    if (!allocator_->register_memory(ptr, bytes)) {
+      INFO("Failed to register %p, %lld bytes as pinned memory", ptr, (long long)bytes);
+      return false;
+    }
+
+    unique_lock<mutex> l(lock_);
+    ranges_[(uintptr_t)ptr] = Range{bytes, true};
+    return true;
+  }
+
+  virtual void unregister_memory(void *ptr) override {
+    {
+      unique_lock<mutex> l(lock_);
+      auto iter = ranges_.find((uintptr_t)ptr);
+      if (iter == ranges_.end() || !iter->second.registered) return;
+      ranges_.erase(iter);
+    }
+    allocator_->unregister_memory(ptr);
+  }
+
+  virtual bool is_pinned(const void *ptr, size_t bytes) override {
+    uintptr_t begin = (uintptr_t)ptr;
+    unique_lock<mutex> l(lock_);
+    auto iter = ranges_.upper_bound(begin);
+    if (iter == ranges_.begin()) return false;
+
+    --iter;
+    return begin + bytes <= iter->first + iter->second.bytes;
+  }
+
+  virtual size_t num_free() override {
+    unique_lock<mutex> l(lock_);
+    return free_.size();
+  }
+
+  virtual size_t cached_bytes() override {
+    unique_lock<mutex> l(lock_);
+    return cached_bytes_;
+  }
+};
+
+std::shared_ptr<PinnedPool> create_pinned_pool(std::shared_ptr<HostAllocator> allocator,
+                                               size_t max_cached_bytes) {
+  if (allocator == nullptr) return nullptr;
+  return make_shared<PinnedPoolImpl>(allocator, max_cached_bytes);
+}
+
+};  // namespace trt
@@ -0,0 +1,93 @@
+#include "tile.hpp"
+
+#include <algorithm>
+
+namespace tile {
+
+using namespace std;
+
+// start of every tile along one axis, the last one flush with the end (rounded down to even)
+static vector<int> tile_starts(int size, int tile, float overlap) {
+  vector<int> starts;
+  if (size <= tile) {
+    starts.push_back(0);
+    return starts;
+  }
+
+  int step = std::max(2, (int)(tile * (1 - overlap)));
+  int last = (size - tile) & ~1;
+  for (int start = 0; start < last; start += step) starts.push_back(start & ~1);
+  if (starts.empty() || starts.back() != last) starts.push_back(last);
+  return starts;
+}
+
+vector<Tile> make_tiles(int width, int height, const Config &config) {
+  vector<Tile> tiles;
+  if (width <= 0 || height <= 0 || config.tile_width <= 0 || config.tile_height <= 0)
+    return tiles;
+
+  float overlap = std::min(std::max(config.overlap, 0.0f), 0.95f);
+  vector<int> xs = tile_starts(width, config.tile_width, overlap);
+  vector<int> ys = tile_starts(height, config.tile_height, overlap);
+  for (int y : ys) {
+    // the last tile takes the pixel lost by the even rounding
+    int tile_height = y == ys.back() ? height - y : config.tile_height;
+    for (int x : xs) {
+      int tile_width = x == xs.back() ? width - x : config.tile_width;
+      tiles.emplace_back(x, y, tile_width, tile_height);
+    }
+  }
+  return tiles;
+}
+
+void map_to_image(yolo::BoxArray &boxes, const Tile &tile) {
+  for (auto &box : boxes) {
+    box.left += tile.x;
+    box.right += tile.x;
+    box.top += tile.y;
+    box.bottom += tile.y;
+  }
+}
+
+yolo::BoxArray merge(vector<yolo::BoxArray> &tile_boxes, const vector<Tile> &tiles,
+                     const Config &config) {
+  yolo::BoxArray boxes;
+  for (size_t i = 0; i < tile_boxes.size() && i < tiles.size(); ++i) {
+    map_to_image(tile_boxes[i], tiles[i]);
+    boxes.insert(boxes.end(), tile_boxes[i].begin(), tile_boxes[i].end());
+  }
+  return yolo::cpu::nms(boxes, config.nms_threshold, config.class_agnostic);
+}
+
+yolo::BoxArray forward(const Forwards &forwards, const yolo::Image &image, const Config &config) {
+  vector<Tile> tiles = make_tiles(image.width, image.height, config);
+  if (config.full_frame && tiles.size() > 1) tiles.emplace_back(0, 0, image.width, image.height);
+
+  vector<yolo::Image> crops;
+  crops.reserve(tiles.size());
+  for (auto &tile : tiles) crops.push_back(image.crop(tile.x, tile.y, tile.width, tile.height));
+
+  // as many tiles per call as the engine takes, the dynamic batch is filled
+  size_t max_batch = std::max(config.max_batch, 1);
+  vector<yolo::BoxArray> tile_boxes;
+  tile_boxes.reserve(tiles.size());
+  vector<yolo::Image> chunk;
+  for (size_t first = 0; first < crops.size(); first += max_batch) {
+    chunk.assign(crops.begin() + first, crops.begin() + std::min(crops.size(), first + max_batch));
+    vector<yolo::BoxArray> result = forwards(chunk);
+    if (result.size() != chunk.size()) return {};
+
+    for (auto &boxes : result) tile_boxes.emplace_back(std::move(boxes));
+  }
+  return merge(tile_boxes, tiles, config);
+}
+
+yolo::BoxArray forward(yolo::Infer *model, const yolo::Image &image, const Config &config,
+                       void *stream) {
+  auto forwards = [&](const vector<yolo::Image> &images) {
+    return model->forwards(images, stream);
+  };
+  return forward(forwards, image, config);
+}
+
+};  // namespace tile
@@ -0,0 +1,53 @@
+#ifndef __TILE_HPP__
+#define __TILE_HPP__
+
+#include <functional>
+#include <vector>
+
+#include "yolo.hpp"
+
+// Tiled (SAHI style) inference: a large image is cut into overlapping tiles that run as one
+// batch, their boxes are shifted back into the image and merged by a global nms. Everything here
+// runs on the host, the model is any forwards function, so the tiling can be driven by a fake.
+namespace tile {
+
+struct Config {
+  int tile_width = 640, tile_height = 640;
+  float overlap = 0.2f;        // fraction of a tile shared with its neighbour, [0, 1)
+  bool full_frame = true;      // also run the whole image, for the objects larger than a tile
+  int max_batch = 16;          // images per forwards call, the max batch of the engine profile
+  float nms_threshold = 0.5f;  // of the merge across tiles
+  bool class_agnostic = false;
+};
+
+// area of the image seen by one forward, in image pixels
+struct Tile {
+  int x = 0, y = 0, width = 0, height = 0;
+
+  Tile() = default;
+  Tile(int x, int y, int width, int height) : x(x), y(y), width(width), height(height) {}
+};
+
+typedef std::function<std::vector<yolo::BoxArray>(const std::vector<yolo::Image> &)> Forwards;
+
+// Overlapping tiles covering a width x height image, row by row. The last row and column are
+// moved inward so that every tile has the full size, an image smaller than a tile is one tile.
+// x and y are even so that the crops of 4:2:0 images fall on them exactly.
+std::vector<Tile> make_tiles(int width, int height, const Config &config);
+
+// boxes of a tile forward, in tile coordinates, shifted into the image
+void map_to_image(yolo::BoxArray &boxes, const Tile &tile);
+
+// all boxes of the tiles mapped into the image, then the global nms
+yolo::BoxArray merge(std::vector<yolo::BoxArray> &tile_boxes, const std::vector<Tile> &tiles,
+                     const Config &config);
+
+// Crops the tiles (plus the full frame), forwards them in chunks of max_batch and merges the
+// result. Empty if a forwards call failed.
+yolo::BoxArray forward(const Forwards &forwards, const yolo::Image &image, const Config &config);
+yolo::BoxArray forward(yolo::Infer *model, const yolo::Image &image, const Config &config,
+                       void *stream = nullptr);
+
+};  // namespace tile
+
+#endif  // __TILE_HPP__
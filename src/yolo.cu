@@ -1,6 +1,9 @@
+#include "graph_cache.hpp"
 #include "infer.hpp"
 #include "yolo.hpp"
+#include "yolo_kernel.hpp"
 #include <cuda_runtime.h>
+#include <cuda_fp16.h>
 
 namespace yolo {
 
@@ -24,29 +27,6 @@ using namespace std;
     checkRuntime(cudaPeekAtLastError()); \
   } while (0)
 
-enum class NormType : int { None = 0, MeanStd = 1, AlphaBeta = 2 };
-
-enum class ChannelType : int { None = 0, SwapRB = 1 };
-
-/* 归一化操作，可以支持均值标准差，alpha beta，和swap RB */
-struct Norm {
-  float mean[3];
-  float std[3];
-  float alpha, beta;
-  NormType type = NormType::None;
-  ChannelType channel_type = ChannelType::None;
-
-  // out = (x * alpha - mean) / std
-  static Norm mean_std(const float mean[3], const float std[3], float alpha = 1 / 255.0f,
-                       ChannelType channel_type = ChannelType::None);
-
-  // out = x * alpha + beta
-  static Norm alpha_beta(float alpha, float beta = 0, ChannelType channel_type = ChannelType::None);
-
-  // None
-  static Norm None();
-};
-
 Norm Norm::mean_std(const float mean[3], const float std[3], float alpha,
                     ChannelType channel_type) {
   Norm out;
@@ -71,45 +51,98 @@ Norm Norm::None() { return Norm(); }
 
 const int NUM_BOX_ELEMENT = 8;  // left, top, right, bottom, confidence, class,
                                 // keepflag, row_index(output)
-const int MAX_IMAGE_BOXES = 1024;
+const int MAX_IMAGE_BOXES = 1024;  // default of the pre-nms top-k
 inline int upbound(int n, int align = 32) { return (n + align - 1) / align * align; }
+// not fused into fma, so that the boxes equal the ones of cpu::decode_boxes bit for bit
 static __host__ __device__ void affine_project(float *matrix, float x, float y, float *ox,
                                                float *oy) {
-  *ox = matrix[0] * x + matrix[1] * y + matrix[2];
-  *oy = matrix[3] * x + matrix[4] * y + matrix[5];
+  *ox = add_rn(add_rn(mul_rn(matrix[0], x), mul_rn(matrix[1], y)), matrix[2]);
+  *oy = add_rn(add_rn(mul_rn(matrix[3], x), mul_rn(matrix[4], y)), matrix[5]);
+}
+
+// 4 scores in one 16 (float) or 8 (half) byte load
+static __device__ inline void load4(const float *p, float *out) {
+  float4 v = *(const float4 *)p;
+  out[0] = v.x;
+  out[1] = v.y;
+  out[2] = v.z;
+  out[3] = v.w;
+}
+
+static __device__ inline void load4(const __half *p, float *out) {
+  uint2 raw = *(const uint2 *)p;
+  float2 low = __half22float2(*(const __half2 *)&raw.x);
+  float2 high = __half22float2(*(const __half2 *)&raw.y);
+  out[0] = low.x;
+  out[1] = low.y;
+  out[2] = high.x;
+  out[3] = high.y;
 }
 
-static __global__ void decode_kernel_common(float *predict, int num_bboxes, int num_classes,
+// argmax_classes with vector loads, scores must be aligned to 4 elements
+template <int NUM_CLASSES, typename T>
+static __device__ inline void argmax_classes_vec4(const T *scores, int num_classes,
+                                                  float &confidence, int &label) {
+  const int n = NUM_CLASSES > 0 ? NUM_CLASSES : num_classes;
+  confidence = load_value(scores);
+  label = 0;
+
+  int i = 0;
+#pragma unroll
+  for (; i + 4 <= n; i += 4) {
+    float value[4];
+    load4(scores + i, value);
+#pragma unroll
+    for (int k = 0; k < 4; ++k) {
+      if (value[k] > confidence) {
+        confidence = value[k];
+        label = i + k;
+      }
+    }
+  }
+
+  for (; i < n; ++i) {
+    float value = load_value(scores + i);
+    if (value > confidence) {
+      confidence = value;
+      label = i;
+    }
+  }
+}
+
+template <typename T, int NUM_CLASSES>
+static __global__ void decode_kernel_common(const T *predict, int num_bboxes, int num_classes,
                                             int output_cdim, float confidence_threshold,
+                                            const float *class_thresholds,
                                             float *invert_affine_matrix, float *parray,
-                                            int MAX_IMAGE_BOXES) {
+                                            int max_candidates, int *flags) {
   int position = blockDim.x * blockIdx.x + threadIdx.x;
   if (position >= num_bboxes) return;
 
-  float *pitem = predict + output_cdim * position;
-  float objectness = pitem[4];
+  const T *pitem = predict + output_cdim * position;
+  float objectness = load_value(pitem + 4);
   if (objectness < confidence_threshold) return;
 
-  float *class_confidence = pitem + 5;
-  float confidence = *class_confidence++;
-  int label = 0;
-  for (int i = 1; i < num_classes; ++i, ++class_confidence) {
-    if (*class_confidence > confidence) {
-      confidence = *class_confidence;
-      label = i;
-    }
-  }
+  float confidence;
+  int label;
+  argmax_classes<NUM_CLASSES>(pitem + 5, num_classes, confidence, label);
 
   confidence *= objectness;
-  if (confidence < confidence_threshold) return;
+  if (confidence < (class_thresholds ? class_thresholds[label] : confidence_threshold)) return;
 
-  int index = atomicAdd(parray, 1);
-  if (index >= MAX_IMAGE_BOXES) return;
+  // ordered mode: every anchor has its own slot, compact_topk_kernel packs them in order
+  int index = position;
+  if (flags) {
+    flags[position] = 1;
+  } else {
+    index = atomicAdd(parray, 1);
+    if (index >= max_candidates) return;
+  }
 
-  float cx = *pitem++;
-  float cy = *pitem++;
-  float width = *pitem++;
-  float height = *pitem++;
+  float cx = load_value(pitem++);
+  float cy = load_value(pitem++);
+  float width = load_value(pitem++);
+  float height = load_value(pitem++);
   float left = cx - width * 0.5f;
   float top = cy - height * 0.5f;
   float right = cx + width * 0.5f;
@@ -127,32 +160,37 @@ static __global__ void decode_kernel_common(float *predict, int num_bboxes, int
   *pout_item++ = 1;  // 1 = keep, 0 = ignore
 }
 
-static __global__ void decode_kernel_v8(float *predict, int num_bboxes, int num_classes,
+template <typename T, int NUM_CLASSES, bool VEC4>
+static __global__ void decode_kernel_v8(const T *predict, int num_bboxes, int num_classes,
                                         int output_cdim, float confidence_threshold,
+                                        const float *class_thresholds,
                                         float *invert_affine_matrix, float *parray,
-                                        int MAX_IMAGE_BOXES) {
+                                        int max_candidates, int *flags) {
   int position = blockDim.x * blockIdx.x + threadIdx.x;
   if (position >= num_bboxes) return;
 
-  float *pitem = predict + output_cdim * position;
-  float *class_confidence = pitem + 4;
-  float confidence = *class_confidence++;
-  int label = 0;
-  for (int i = 1; i < num_classes; ++i, ++class_confidence) {
-    if (*class_confidence > confidence) {
-      confidence = *class_confidence;
-      label = i;
-    }
+  const T *pitem = predict + output_cdim * position;
+  float confidence;
+  int label;
+  if (VEC4)
+    argmax_classes_vec4<NUM_CLASSES>(pitem + 4, num_classes, confidence, label);
+  else
+    argmax_classes<NUM_CLASSES>(pitem + 4, num_classes, confidence, label);
+  if (confidence < (class_thresholds ? class_thresholds[label] : confidence_threshold)) return;
+
+  // ordered mode: every anchor has its own slot, compact_topk_kernel packs them in order
+  int index = position;
+  if (flags) {
+    flags[position] = 1;
+  } else {
+    index = atomicAdd(parray, 1);
+    if (index >= max_candidates) return;
   }
-  if (confidence < confidence_threshold) return;
 
-  int index = atomicAdd(parray, 1);
-  if (index >= MAX_IMAGE_BOXES) return;
-
-  float cx = *pitem++;
-  float cy = *pitem++;
-  float width = *pitem++;
-  float height = *pitem++;
+  float cx = load_value(pitem++);
+  float cy = load_value(pitem++);
+  float width = load_value(pitem++);
+  float height = load_value(pitem++);
   float left = cx - width * 0.5f;
   float top = cy - height * 0.5f;
   float right = cx + width * 0.5f;
@@ -178,15 +216,16 @@ static __device__ float box_iou(float aleft, float atop, float aright, float abo
   float cright = min(aright, bright);
   float cbottom = min(abottom, bbottom);
 
-  float c_area = max(cright - cleft, 0.0f) * max(cbottom - ctop, 0.0f);
+  float c_area = mul_rn(max(cright - cleft, 0.0f), max(cbottom - ctop, 0.0f));
   if (c_area == 0.0f) return 0.0f;
 
-  float a_area = max(0.0f, aright - aleft) * max(0.0f, abottom - atop);
-  float b_area = max(0.0f, bright - bleft) * max(0.0f, bbottom - btop);
-  return c_area / (a_area + b_area - c_area);
+  float a_area = mul_rn(max(0.0f, aright - aleft), max(0.0f, abottom - atop));
+  float b_area = mul_rn(max(0.0f, bright - bleft), max(0.0f, bbottom - btop));
+  return c_area / add_rn(add_rn(a_area, b_area), -c_area);
 }
 
-static __global__ void fast_nms_kernel(float *bboxes, int MAX_IMAGE_BOXES, float threshold) {
+static __global__ void fast_nms_kernel(float *bboxes, int MAX_IMAGE_BOXES, float threshold,
+                                       bool class_agnostic) {
   int position = (blockDim.x * blockIdx.x + threadIdx.x);
   int count = min((int)*bboxes, MAX_IMAGE_BOXES);
   if (position >= count) return;
@@ -196,7 +235,7 @@ static __global__ void fast_nms_kernel(float *bboxes, int MAX_IMAGE_BOXES, float
   for (int i = 0; i < count; ++i) {
     float *pitem = bboxes + 1 + i * NUM_BOX_ELEMENT;
     // continue是保留当前目标框
-    if (i == position || pcurrent[5] != pitem[5]) continue;
+    if (i == position || (!class_agnostic && pcurrent[5] != pitem[5])) continue;
 
     if (pitem[4] >= pcurrent[4]) {
       // 对于相同置信度的框保留索引较大的目标框，因为表明是后出现的目标框，更有可能是真实目标而非重复框
@@ -213,6 +252,170 @@ static __global__ void fast_nms_kernel(float *bboxes, int MAX_IMAGE_BOXES, float
   }
 }
 
+// Order preserving key of a float, larger confidence = larger key
+static __device__ inline unsigned int confidence_key(float value) {
+  unsigned int bits = __float_as_uint(value);
+  return bits & 0x80000000 ? ~bits : bits | 0x80000000;
+}
+
+// Key of the max_boxes-th largest confidence among the n boxes (those with flags[i] set, when
+// flags is given), by a radix select of 8 bits per pass from the top. rank is how many boxes with
+// exactly that key belong to the top max_boxes. Needs 256 threads.
+static __device__ void radix_select(const float *boxes, const int *flags, int n, int max_boxes,
+                                   unsigned int &prefix, int &rank) {
+  __shared__ unsigned int histogram[256];
+  __shared__ unsigned int shared_prefix;
+  __shared__ int shared_rank;
+
+  unsigned int mask = 0;
+  prefix = 0;
+  rank = max_boxes;
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    for (int i = threadIdx.x; i < 256; i += blockDim.x) histogram[i] = 0;
+    __syncthreads();
+
+    for (int i = threadIdx.x; i < n; i += blockDim.x) {
+      if (flags && !flags[i]) continue;
+
+      unsigned int key = confidence_key(boxes[i * NUM_BOX_ELEMENT + 4]);
+      if ((key & mask) == prefix) atomicAdd(&histogram[(key >> shift) & 0xFF], 1);
+    }
+    __syncthreads();
+
+    if (threadIdx.x == 0) {
+      int above = 0;
+      for (int bin = 255; bin >= 0; --bin) {
+        if (above + (int)histogram[bin] >= rank) {
+          shared_prefix = prefix | ((unsigned int)bin << shift);
+          shared_rank = rank - above;
+          break;
+        }
+        above += histogram[bin];
+      }
+    }
+    __syncthreads();
+    prefix = shared_prefix;
+    rank = shared_rank;
+    mask |= 0xFFu << shift;
+  }
+}
+
+// One block of 256 threads per image. When more than max_boxes candidates passed the threshold,
+// keep the ones above the key of the max_boxes-th confidence plus just enough of its ties. parray
+// gets at most max_boxes boxes, so the nms cost depends on max_boxes and not on the crowd.
+static __global__ void select_topk_kernel(const float *candidates, int max_candidates,
+                                          float *parray, int max_boxes) {
+  __shared__ int num_greater, num_equal;
+
+  int count = min((int)*candidates, max_candidates);
+  const float *boxes = candidates + 1;
+  float *pout = parray + 1;
+  if (count <= max_boxes) {
+    for (int i = threadIdx.x; i < count * NUM_BOX_ELEMENT; i += blockDim.x) pout[i] = boxes[i];
+    if (threadIdx.x == 0) *parray = count;
+    return;
+  }
+
+  unsigned int prefix;
+  int rank;
+  if (threadIdx.x == 0) {
+    num_greater = 0;
+    num_equal = 0;
+  }
+  radix_select(boxes, nullptr, count, max_boxes, prefix, rank);
+
+  int first_equal = max_boxes - rank;
+  for (int i = threadIdx.x; i < count; i += blockDim.x) {
+    const float *pbox = boxes + i * NUM_BOX_ELEMENT;
+    unsigned int key = confidence_key(pbox[4]);
+    int index = -1;
+    if (key > prefix) {
+      index = atomicAdd(&num_greater, 1);
+    } else if (key == prefix) {
+      index = atomicAdd(&num_equal, 1);
+      index = index < rank ? first_equal + index : -1;
+    }
+
+    if (index >= 0) {
+      for (int k = 0; k < NUM_BOX_ELEMENT; ++k) pout[index * NUM_BOX_ELEMENT + k] = pbox[k];
+    }
+  }
+  __syncthreads();
+  if (threadIdx.x == 0) *parray = max_boxes;
+}
+
+// Exclusive prefix sum of value over the block (blockDim.x a multiple of 32), total gets the sum
+static __device__ int block_exclusive_scan(int value, int &total) {
+  __shared__ int warp_sums[32];
+  int lane = threadIdx.x & 31, warp = threadIdx.x >> 5, num_warps = blockDim.x >> 5;
+  int inclusive = value;
+  for (int offset = 1; offset < 32; offset <<= 1) {
+    int other = __shfl_up_sync(0xFFFFFFFF, inclusive, offset);
+    if (lane >= offset) inclusive += other;
+  }
+  if (lane == 31) warp_sums[warp] = inclusive;
+  __syncthreads();
+
+  if (warp == 0) {
+    int sum = lane < num_warps ? warp_sums[lane] : 0;
+    for (int offset = 1; offset < 32; offset <<= 1) {
+      int other = __shfl_up_sync(0xFFFFFFFF, sum, offset);
+      if (lane >= offset) sum += other;
+    }
+    warp_sums[lane] = sum;
+  }
+  __syncthreads();
+
+  int result = inclusive - value + (warp > 0 ? warp_sums[warp - 1] : 0);
+  total = warp_sums[num_warps - 1];
+  __syncthreads();
+  return result;
+}
+
+// Ordered mode, one block per image. staging has a slot per anchor and flags tells which of them
+// passed the threshold. They are packed into parray in anchor order with prefix sums, taking the
+// top max_boxes (ties at the cut in anchor order) when there are more, so the output only depends
+// on the head and matches cpu::decode_boxes.
+static __global__ void compact_topk_kernel(const float *staging, const int *flags, int num_bboxes,
+                                           float *parray, int max_boxes) {
+  __shared__ int shared_count;
+  const float *boxes = staging + 1;
+  float *pout = parray + 1;
+
+  if (threadIdx.x == 0) shared_count = 0;
+  __syncthreads();
+
+  int local_count = 0;
+  for (int i = threadIdx.x; i < num_bboxes; i += blockDim.x) local_count += flags[i];
+  atomicAdd(&shared_count, local_count);
+  __syncthreads();
+
+  bool select = shared_count > max_boxes;
+  unsigned int prefix = 0;
+  int rank = 0;
+  if (select) radix_select(boxes, flags, num_bboxes, max_boxes, prefix, rank);
+
+  int written = 0, ties = 0;
+  for (int base = 0; base < num_bboxes; base += blockDim.x) {
+    int i = base + threadIdx.x;
+    bool valid = i < num_bboxes && flags[i];
+    unsigned int key = valid ? confidence_key(boxes[i * NUM_BOX_ELEMENT + 4]) : 0;
+    bool equal = valid && select && key == prefix;
+
+    int num_equal, num_keep;
+    int tie_index = ties + block_exclusive_scan(equal, num_equal);
+    bool keep = valid && (!select || key > prefix || (equal && tie_index < rank));
+    int index = written + block_exclusive_scan(keep, num_keep);
+    if (keep) {
+      const float *pbox = boxes + i * NUM_BOX_ELEMENT;
+      for (int k = 0; k < NUM_BOX_ELEMENT; ++k) pout[index * NUM_BOX_ELEMENT + k] = pbox[k];
+    }
+    written += num_keep;
+    ties += num_equal;
+  }
+  if (threadIdx.x == 0) *parray = written;
+}
+
 static dim3 grid_dims(int numJobs) {
   int numBlockThreads = numJobs < GPU_BLOCK_THREADS ? numJobs : GPU_BLOCK_THREADS;
   return dim3(((numJobs + numBlockThreads - 1) / (float)numBlockThreads));
@@ -222,126 +425,108 @@ static dim3 block_dims(int numJobs) {
   return numJobs < GPU_BLOCK_THREADS ? numJobs : GPU_BLOCK_THREADS;
 }
 
-static void decode_kernel_invoker(float *predict, int num_bboxes, int num_classes, int output_cdim,
-                                  float confidence_threshold, float nms_threshold,
-                                  float *invert_affine_matrix, float *parray, int MAX_IMAGE_BOXES,
+template <typename T, int NUM_CLASSES>
+struct DecodeKernel {
+  static void run(const T *predict, int num_bboxes, int num_classes, int output_cdim,
+                  float confidence_threshold, const float *class_thresholds,
+                  float *invert_affine_matrix, float *parray, int max_candidates, int *flags,
+                  Type type, cudaStream_t stream) {
+    auto grid = grid_dims(num_bboxes);
+    auto block = block_dims(num_bboxes);
+
+    // 红色波浪线报的不是checkKernel的错误，而是<<<>>>识别不出来
+    if (type == Type::V8 || type == Type::V8Seg) {
+      // the scores start at element 4 of each row, aligned when the rows are
+      bool vec4 = output_cdim % 4 == 0 && (uintptr_t)predict % (4 * sizeof(T)) == 0;
+      if (vec4) {
+        checkKernel(decode_kernel_v8<T, NUM_CLASSES, true><<<grid, block, 0, stream>>>(
+            predict, num_bboxes, num_classes, output_cdim, confidence_threshold,
+            class_thresholds, invert_affine_matrix, parray, max_candidates, flags));
+      } else {
+        checkKernel(decode_kernel_v8<T, NUM_CLASSES, false><<<grid, block, 0, stream>>>(
+            predict, num_bboxes, num_classes, output_cdim, confidence_threshold,
+            class_thresholds, invert_affine_matrix, parray, max_candidates, flags));
+      }
+    } else {
+      checkKernel(decode_kernel_common<T, NUM_CLASSES><<<grid, block, 0, stream>>>(
+          predict, num_bboxes, num_classes, output_cdim, confidence_threshold,
+          class_thresholds, invert_affine_matrix, parray, max_candidates, flags));
+    }
+  }
+};
+
+// candidates has room for every anchor (1 + num_bboxes * NUM_BOX_ELEMENT), its count must be
+// zero. parray receives the top max_boxes of them after nms. With flags (num_bboxes zeroed ints)
+// the decode is ordered: anchor order instead of atomic order, the same on every run.
+// class_thresholds (device, one per class) replaces confidence_threshold, which must then be the
+// lowest of them.
+template <typename T>
+static void decode_kernel_invoker(const T *predict, int num_bboxes, int num_classes,
+                                  int output_cdim, float confidence_threshold,
+                                  const float *class_thresholds, float nms_threshold,
+                                  bool class_agnostic, float *invert_affine_matrix,
+                                  float *candidates, int *flags, float *parray, int max_boxes,
                                   Type type, cudaStream_t stream) {
-  auto grid = grid_dims(num_bboxes);
-  auto block = block_dims(num_bboxes);
-
-  // 红色波浪线报的不是checkKernel的错误，而是<<<>>>识别不出来
-  if (type == Type::V8 || type == Type::V8Seg) {
-    checkKernel(decode_kernel_v8<<<grid, block, 0, stream>>>(
-        predict, num_bboxes, num_classes, output_cdim, confidence_threshold, invert_affine_matrix,
-        parray, MAX_IMAGE_BOXES));
+  dispatch_num_classes<DecodeKernel, T>(num_classes, predict, num_bboxes, num_classes,
+                                        output_cdim, confidence_threshold, class_thresholds,
+                                        invert_affine_matrix, candidates, num_bboxes, flags, type,
+                                        stream);
+
+  if (flags) {
+    checkKernel(compact_topk_kernel<<<1, 1024, 0, stream>>>(candidates, flags, num_bboxes,
+                                                            parray, max_boxes));
   } else {
-    checkKernel(decode_kernel_common<<<grid, block, 0, stream>>>(
-        predict, num_bboxes, num_classes, output_cdim, confidence_threshold, invert_affine_matrix,
-        parray, MAX_IMAGE_BOXES));
+    checkKernel(select_topk_kernel<<<1, 256, 0, stream>>>(candidates, num_bboxes, parray,
+                                                          max_boxes));
   }
 
-  grid = grid_dims(MAX_IMAGE_BOXES);
-  block = block_dims(MAX_IMAGE_BOXES);
-  checkKernel(fast_nms_kernel<<<grid, block, 0, stream>>>(parray, MAX_IMAGE_BOXES, nms_threshold));
+  auto grid = grid_dims(max_boxes);
+  auto block = block_dims(max_boxes);
+  checkKernel(fast_nms_kernel<<<grid, block, 0, stream>>>(parray, max_boxes, nms_threshold,
+                                                         class_agnostic));
 }
 
-static __global__ void warp_affine_bilinear_and_normalize_plane_kernel(
-    uint8_t *src, int src_line_size, int src_width, int src_height, float *dst, int dst_width,
-    int dst_height, uint8_t const_value_st, float *warp_affine_matrix_2_3, Norm norm) {
+template <NormType norm_type, ChannelType channel_type, Interp interp, typename TOut>
+static __global__ void warp_affine_normalize_plane_kernel(PlaneView src, TOut *dst, int dst_width,
+                                                          int dst_height, uint8_t const_value,
+                                                          Matrix2x3 matrix, NormParams norm) {
   int dx = blockDim.x * blockIdx.x + threadIdx.x;
   int dy = blockDim.y * blockIdx.y + threadIdx.y;
   if (dx >= dst_width || dy >= dst_height) return;
 
-  float m_x1 = warp_affine_matrix_2_3[0];
-  float m_y1 = warp_affine_matrix_2_3[1];
-  float m_z1 = warp_affine_matrix_2_3[2];
-  float m_x2 = warp_affine_matrix_2_3[3];
-  float m_y2 = warp_affine_matrix_2_3[4];
-  float m_z2 = warp_affine_matrix_2_3[5];
-
-  float src_x = m_x1 * dx + m_y1 * dy + m_z1;
-  float src_y = m_x2 * dx + m_y2 * dy + m_z2;
-  float c0, c1, c2;
-
-  if (src_x <= -1 || src_x >= src_width || src_y <= -1 || src_y >= src_height) {
-    // out of range
-    c0 = const_value_st;
-    c1 = const_value_st;
-    c2 = const_value_st;
-  } else {
-    int y_low = floorf(src_y);
-    int x_low = floorf(src_x);
-    int y_high = y_low + 1;
-    int x_high = x_low + 1;
-
-    uint8_t const_value[] = {const_value_st, const_value_st, const_value_st};
-    float ly = src_y - y_low;
-    float lx = src_x - x_low;
-    float hy = 1 - ly;
-    float hx = 1 - lx;
-    float w1 = hy * hx, w2 = hy * lx, w3 = ly * hx, w4 = ly * lx;
-    uint8_t *v1 = const_value;
-    uint8_t *v2 = const_value;
-    uint8_t *v3 = const_value;
-    uint8_t *v4 = const_value;
-    if (y_low >= 0) {
-      if (x_low >= 0) v1 = src + y_low * src_line_size + x_low * 3;
-
-      if (x_high < src_width) v2 = src + y_low * src_line_size + x_high * 3;
-    }
-
-    if (y_high < src_height) {
-      if (x_low >= 0) v3 = src + y_high * src_line_size + x_low * 3;
-
-      if (x_high < src_width) v4 = src + y_high * src_line_size + x_high * 3;
-    }
-
-    // same to opencv
-    c0 = floorf(w1 * v1[0] + w2 * v2[0] + w3 * v3[0] + w4 * v4[0] + 0.5f);
-    c1 = floorf(w1 * v1[1] + w2 * v2[1] + w3 * v3[1] + w4 * v4[1] + 0.5f);
-    c2 = floorf(w1 * v1[2] + w2 * v2[2] + w3 * v3[2] + w4 * v4[2] + 0.5f);
-  }
-
-  if (norm.channel_type == ChannelType::SwapRB) {
-    float t = c2;
-    c2 = c0;
-    c0 = t;
-  }
-
-  if (norm.type == NormType::MeanStd) {
-    c0 = (c0 * norm.alpha - norm.mean[0]) / norm.std[0];
-    c1 = (c1 * norm.alpha - norm.mean[1]) / norm.std[1];
-    c2 = (c2 * norm.alpha - norm.mean[2]) / norm.std[2];
-  } else if (norm.type == NormType::AlphaBeta) {
-    c0 = c0 * norm.alpha + norm.beta;
-    c1 = c1 * norm.alpha + norm.beta;
-    c2 = c2 * norm.alpha + norm.beta;
-  }
-
-  int area = dst_width * dst_height;
-  float *pdst_c0 = dst + dy * dst_width + dx;
-  float *pdst_c1 = pdst_c0 + area;
-  float *pdst_c2 = pdst_c1 + area;
-  *pdst_c0 = c0;
-  *pdst_c1 = c1;
-  *pdst_c2 = c2;
+  warp_affine_pixel<norm_type, channel_type, interp>(src, matrix, norm, const_value, dx, dy,
+                                                     dst_width, dst_width * dst_height, dst);
 }
 
-static void warp_affine_bilinear_and_normalize_plane(uint8_t *src, int src_line_size, int src_width,
-                                                     int src_height, float *dst, int dst_width,
-                                                     int dst_height, float *matrix_2_3,
-                                                     uint8_t const_value, const Norm &norm,
-                                                     cudaStream_t stream) {
-  dim3 grid((dst_width + 31) / 32, (dst_height + 31) / 32);
-  dim3 block(32, 32);
+template <NormType norm_type, ChannelType channel_type, Interp interp, typename TOut>
+struct WarpAffineKernel {
+  static void run(const PlaneView &src, TOut *dst, int dst_width, int dst_height,
+                  uint8_t const_value, const Matrix2x3 &matrix, const NormParams &norm,
+                  cudaStream_t stream) {
+    dim3 grid((dst_width + 31) / 32, (dst_height + 31) / 32);
+    dim3 block(32, 32);
+
+    checkKernel(
+        warp_affine_normalize_plane_kernel<norm_type, channel_type, interp, TOut>
+        <<<grid, block, 0, stream>>>(src, dst, dst_width, dst_height, const_value, matrix, norm));
+  }
+};
 
-  checkKernel(warp_affine_bilinear_and_normalize_plane_kernel<<<grid, block, 0, stream>>>(
-      src, src_line_size, src_width, src_height, dst, dst_width, dst_height, const_value,
-      matrix_2_3, norm));
+// src is the packed upload on device, yuv formats are converted to bgr while sampling. int8_scale
+// only applies to int8 output.
+template <typename TOut>
+static void warp_affine_normalize_plane(const PlaneView &src, TOut *dst, int dst_width,
+                                        int dst_height, const float *matrix_2_3,
+                                        uint8_t const_value, const Norm &norm, Interp interp,
+                                        float int8_scale, cudaStream_t stream) {
+  dispatch_preprocess<WarpAffineKernel, TOut>(norm, interp, src, dst, dst_width, dst_height,
+                                              const_value, make_matrix(matrix_2_3),
+                                              fold_norm(norm, int8_scale), stream);
 }
 
-static __global__ void decode_single_mask_kernel(int left, int top, float *mask_weights,
-                                                 float *mask_predict, int mask_width,
+template <typename TWeight, typename TPredict>
+static __global__ void decode_single_mask_kernel(int left, int top, const TWeight *mask_weights,
+                                                 const TPredict *mask_predict, int mask_width,
                                                  int mask_height, unsigned char *mask_out,
                                                  int mask_dim, int out_width, int out_height) {
   // mask_predict to mask_out
@@ -359,8 +544,8 @@ static __global__ void decode_single_mask_kernel(int left, int top, float *mask_
 
   float cumprod = 0;
   for (int ic = 0; ic < mask_dim; ++ic) {
-    float cval = mask_predict[(ic * mask_height + sy) * mask_width + sx];
-    float wval = mask_weights[ic];
+    float cval = load_value(mask_predict + (ic * mask_height + sy) * mask_width + sx);
+    float wval = load_value(mask_weights + ic);
     cumprod += cval * wval;
   }
 
@@ -368,9 +553,11 @@ static __global__ void decode_single_mask_kernel(int left, int top, float *mask_
   mask_out[dy * out_width + dx] = alpha * 255;
 }
 
-static void decode_single_mask(float left, float top, float *mask_weights, float *mask_predict,
-                               int mask_width, int mask_height, unsigned char *mask_out,
-                               int mask_dim, int out_width, int out_height, cudaStream_t stream) {
+template <typename TWeight, typename TPredict>
+static void decode_single_mask(float left, float top, const TWeight *mask_weights,
+                               const TPredict *mask_predict, int mask_width, int mask_height,
+                               unsigned char *mask_out, int mask_dim, int out_width,
+                               int out_height, cudaStream_t stream) {
   // mask_weights is mask_dim(32 element) gpu pointer
   dim3 grid((out_width + 31) / 32, (out_height + 31) / 32);
   dim3 block(32, 32);
@@ -397,36 +584,6 @@ const char *type_name(Type type) {
   }
 }
 
-struct AffineMatrix {
-  float i2d[6];  // image to dst(network), 2x3 matrix
-  float d2i[6];  // dst to image, 2x3 matrix
-
-  void compute(const std::tuple<int, int> &from, const std::tuple<int, int> &to) {
-    float scale_x = get<0>(to) / (float)get<0>(from);
-    float scale_y = get<1>(to) / (float)get<1>(from);
-    float scale = std::min(scale_x, scale_y);
-    i2d[0] = scale;
-    i2d[1] = 0;
-    i2d[2] = -scale * get<0>(from) * 0.5 + get<0>(to) * 0.5 + scale * 0.5 - 0.5;
-    i2d[3] = 0;
-    i2d[4] = scale;
-    i2d[5] = -scale * get<1>(from) * 0.5 + get<1>(to) * 0.5 + scale * 0.5 - 0.5;
-
-    double D = i2d[0] * i2d[4] - i2d[1] * i2d[3];
-    D = D != 0. ? double(1.) / D : double(0.);
-    double A11 = i2d[4] * D, A22 = i2d[0] * D, A12 = -i2d[1] * D, A21 = -i2d[3] * D;
-    double b1 = -A11 * i2d[2] - A12 * i2d[5];
-    double b2 = -A21 * i2d[2] - A22 * i2d[5];
-
-    d2i[0] = A11;
-    d2i[1] = A12;
-    d2i[2] = b1;
-    d2i[3] = A21;
-    d2i[4] = A22;
-    d2i[5] = b2;
-  }
-};
-
 InstanceSegmentMap::InstanceSegmentMap(int width, int height) {
   this->width = width;
   this->height = height;
@@ -442,6 +599,54 @@ InstanceSegmentMap::~InstanceSegmentMap() {
   this->height = 0;
 }
 
+// Owns a captured cuda graph, replayed by cudaGraphLaunch
+struct CudaGraph {
+  cudaGraph_t graph = nullptr;
+  cudaGraphExec_t exec = nullptr;
+
+  virtual ~CudaGraph() {
+    if (exec) checkRuntime(cudaGraphExecDestroy(exec));
+    if (graph) checkRuntime(cudaGraphDestroy(graph));
+  }
+};
+
+// Thresholds and filters decode() applies to one image, those of the model or of Image::options
+struct DecodeParams {
+  float lowest_threshold = 0;              // the early exit of the decode kernels
+  const float *class_thresholds = nullptr;  // device, one per class, nullptr = lowest_threshold
+  float nms_threshold = 0;
+  bool class_agnostic = false;
+  int max_detections = 0, max_per_class = 0;
+};
+
+// Per-call scratch of forwards, reset at every call. The vectors keep their capacity, so once
+// the largest batch has been seen forwards does not touch the heap any more.
+struct ForwardArena {
+  vector<AffineMatrix> affine_matrixs;
+  vector<DecodeParams> decode_params;
+  vector<void *> bindings;
+  vector<int> input_dims;
+  vector<int> row_indices, kept;  // rows of the boxes, survivors of limit_detections
+  cpu::LimitBuffers limit;
+
+  void reset(int num_image) {
+    affine_matrixs.resize(num_image);
+    decode_params.resize(num_image);
+    bindings.clear();
+  }
+
+  // capacity for max_batch images of max_boxes boxes, set by warmup
+  void reserve(int max_batch, int max_boxes, int num_classes) {
+    affine_matrixs.reserve(max_batch);
+    decode_params.reserve(max_batch);
+    bindings.reserve(3);
+    input_dims.reserve(8);
+    row_indices.reserve(max_boxes);
+    kept.reserve(max_boxes);
+    limit.reserve(max_boxes, num_classes);
+  }
+};
+
 class InferImpl : public Infer {
  public:
   shared_ptr<trt::Infer> trt_;
@@ -449,31 +654,85 @@ class InferImpl : public Infer {
   Type type_;
   float confidence_threshold_;
   float nms_threshold_;
+  Interp interp_ = Interp::Bilinear;
   vector<shared_ptr<trt::Memory<unsigned char>>> preprocess_buffers_;
-  trt::Memory<float> input_buffer_, bbox_predict_, output_boxarray_;
-  trt::Memory<float> segment_predict_;
-  int network_input_width_, network_input_height_;
+  trt::Memory<unsigned char> input_buffer_;
+  trt::Memory<float> output_boxarray_, candidate_boxes_;
+  trt::Memory<int> candidate_flags_;
+  int max_image_boxes_ = MAX_IMAGE_BOXES;
+  bool ordered_decode_ = false;
+  DecodeParams default_params_;
+  trt::Memory<float> class_thresholds_, image_thresholds_;
+  trt::Memory<unsigned char> bbox_predict_, segment_predict_;
+  int network_input_width_, network_input_height_;  // of the current run shape
+  int height_axis_ = 2, width_axis_ = 3;             // of the input binding
+
+  // dynamic height/width engines run at the opt shape of the profile (target), or in rect mode at
+  // the smallest multiple of 32 that holds the images of the batch
+  bool dynamic_hw_ = false;
+  bool rect_input_ = false;
+  int target_width_ = 0, target_height_ = 0;
+  int min_input_width_ = 0, min_input_height_ = 0;
+  int max_input_width_ = 0, max_input_height_ = 0;
   Norm normalize_;
-  vector<int> bbox_head_dims_;
+  trt::DType input_dtype_ = trt::DType::FLOAT;
+  trt::DType bbox_dtype_ = trt::DType::FLOAT;
+  trt::DType segment_dtype_ = trt::DType::FLOAT;
+  float input_int8_scale_ = 1 / 127.0f;
+  vector<int> bbox_head_dims_;  // of the current run shape
   vector<int> segment_head_dims_;
+  vector<int> max_bbox_dims_, max_segment_dims_;  // at the max input shape, size the buffers
+  int bbox_binding_ = 1;
   int num_classes_ = 0;
   bool has_segment_ = false;
-  bool isdynamic_model_ = false;
+  bool isdynamic_model_ = false;  // dynamic batch
   vector<shared_ptr<trt::Memory<unsigned char>>> box_segment_cache_;
+  vector<int> static_input_dims_;
+  int run_batch_size_ = 0;
+  ForwardArena arena_;
+
+  // cuda graph mode, graphs are keyed by (batch, format, image width, image height)
+  graph::Cache<CudaGraph> graphs_;
+  cudaStream_t graph_stream_ = nullptr;
 
-  virtual ~InferImpl() = default;
+  shared_ptr<trt::PinnedPool> pinned_pool_;
+
+  virtual ~InferImpl() {
+    graphs_.clear();
+    if (graph_stream_) checkRuntime(cudaStreamDestroy(graph_stream_));
+  }
+
+  // captured graphs refer to the buffer addresses, any reallocation makes them stale
+  void check_memory_moved(const void *before, const void *after) {
+    graphs_.check_moved(before, after);
+  }
 
   void adjust_memory(int batch_size) {
-    // the inference batch_size
-    size_t input_numel = network_input_width_ * network_input_height_ * 3;
-    input_buffer_.gpu(batch_size * input_numel);
-    bbox_predict_.gpu(batch_size * bbox_head_dims_[1] * bbox_head_dims_[2]);
-    output_boxarray_.gpu(batch_size * (32 + MAX_IMAGE_BOXES * NUM_BOX_ELEMENT));
-    output_boxarray_.cpu(batch_size * (32 + MAX_IMAGE_BOXES * NUM_BOX_ELEMENT));
+    const void *before[] = {input_buffer_.get_gpu(),     bbox_predict_.get_gpu(),
+                            output_boxarray_.get_gpu(),  output_boxarray_.get_cpu(),
+                            candidate_boxes_.get_gpu(), candidate_flags_.get_gpu(),
+                            segment_predict_.get_gpu()};
+
+    // the inference batch_size at the largest input shape, no reallocation when it changes
+    input_buffer_.gpu(batch_size * (size_t)max_input_width_ * max_input_height_ * 3 *
+                      dtype_bytes(input_dtype_));
+    bbox_predict_.gpu(batch_size * max_bbox_dims_[1] * max_bbox_dims_[2] *
+                      dtype_bytes(bbox_dtype_));
+    output_boxarray_.gpu(batch_size * boxarray_stride());
+    output_boxarray_.cpu(batch_size * boxarray_stride());
+    candidate_boxes_.gpu(batch_size * (32 + max_bbox_dims_[1] * NUM_BOX_ELEMENT));
+    candidate_flags_.gpu(batch_size * max_bbox_dims_[1]);
 
     if (has_segment_)
-      segment_predict_.gpu(batch_size * segment_head_dims_[1] * segment_head_dims_[2] *
-                           segment_head_dims_[3]);
+      segment_predict_.gpu(batch_size * max_segment_dims_[1] * max_segment_dims_[2] *
+                           max_segment_dims_[3] * dtype_bytes(segment_dtype_));
+
+    const void *after[] = {input_buffer_.get_gpu(),     bbox_predict_.get_gpu(),
+                           output_boxarray_.get_gpu(),  output_boxarray_.get_cpu(),
+                           candidate_boxes_.get_gpu(), candidate_flags_.get_gpu(),
+                           segment_predict_.get_gpu()};
+    for (int i = 0; i < (int)(sizeof(before) / sizeof(before[0])); ++i)
+      check_memory_moved(before[i], after[i]);
 
     if ((int)preprocess_buffers_.size() < batch_size) {
       for (int i = preprocess_buffers_.size(); i < batch_size; ++i)
@@ -481,59 +740,536 @@ class InferImpl : public Infer {
     }
   }
 
-  void preprocess(int ibatch, const Image &image,
-                  shared_ptr<trt::Memory<unsigned char>> preprocess_buffer, AffineMatrix &affine,
-                  void *stream = nullptr) {
+  // host part of preprocess: compute the affine, stage the matrix into pinned memory and upload
+  // the image. The image upload stays outside of the cuda graph because its source pointer
+  // changes from call to call.
+  void stage(const Image &image, const shared_ptr<trt::Memory<unsigned char>> &preprocess_buffer,
+             AffineMatrix &affine, cudaStream_t stream) {
     affine.compute(make_tuple(image.width, image.height),
                    make_tuple(network_input_width_, network_input_height_));
 
-    size_t input_numel = network_input_width_ * network_input_height_ * 3;
-    float *input_device = input_buffer_.gpu() + ibatch * input_numel;
-    size_t size_image = image.width * image.height * 3;
+    PlaneView view = plane_view(image);
+    size_t size_image = packed_bytes(view);
     size_t size_matrix = upbound(sizeof(affine.d2i), 32);
+
+    // images in leased or registered pinned memory are copied to device directly
+    bool pinned = true;
+    for (int i = 0; i < view.num_planes && pinned; ++i) {
+      size_t span = (size_t)view.line_size[i] * (view.rows[i] - 1) + view.row_bytes[i];
+      pinned = pinned_pool_->is_pinned(view.data[i], span);
+    }
+
+    const void *gpu_before = preprocess_buffer->get_gpu();
+    const void *cpu_before = preprocess_buffer->get_cpu();
     uint8_t *gpu_workspace = preprocess_buffer->gpu(size_matrix + size_image);
-    float *affine_matrix_device = (float *)gpu_workspace;
-    uint8_t *image_device = gpu_workspace + size_matrix;
+    uint8_t *cpu_workspace = preprocess_buffer->cpu(size_matrix + (pinned ? 0 : size_image));
+    check_memory_moved(gpu_before, preprocess_buffer->get_gpu());
+    check_memory_moved(cpu_before, preprocess_buffer->get_cpu());
 
-    uint8_t *cpu_workspace = preprocess_buffer->cpu(size_matrix + size_image);
     float *affine_matrix_host = (float *)cpu_workspace;
-    uint8_t *image_host = cpu_workspace + size_matrix;
-
-    // speed up
-    cudaStream_t stream_ = (cudaStream_t)stream;
-    memcpy(image_host, image.bgrptr, size_image);
     memcpy(affine_matrix_host, affine.d2i, sizeof(affine.d2i));
-    checkRuntime(
-        cudaMemcpyAsync(image_device, image_host, size_image, cudaMemcpyHostToDevice, stream_));
-    checkRuntime(cudaMemcpyAsync(affine_matrix_device, affine_matrix_host, sizeof(affine.d2i),
-                                 cudaMemcpyHostToDevice, stream_));
 
-    warp_affine_bilinear_and_normalize_plane(image_device, image.width * 3, image.width,
-                                             image.height, input_device, network_input_width_,
-                                             network_input_height_, affine_matrix_device, 114,
-                                             normalize_, stream_);
+    // planes are packed on device, strided or cropped images are gathered by the copy
+    PlaneView device = packed_view(view, gpu_workspace + size_matrix);
+    PlaneView host = view;
+    if (!pinned) {
+      host = packed_view(view, cpu_workspace + size_matrix);
+      for (int i = 0; i < view.num_planes; ++i) {
+        uint8_t *staging = (uint8_t *)host.data[i];
+        if (view.line_size[i] == view.row_bytes[i]) {
+          memcpy(staging, view.data[i], (size_t)view.row_bytes[i] * view.rows[i]);
+        } else {
+          for (int y = 0; y < view.rows[i]; ++y)
+            memcpy(staging + y * view.row_bytes[i], view.data[i] + y * view.line_size[i],
+                   view.row_bytes[i]);
+        }
+      }
+    }
+
+    for (int i = 0; i < view.num_planes; ++i) {
+      checkRuntime(cudaMemcpy2DAsync((void *)device.data[i], device.line_size[i], host.data[i],
+                                     host.line_size[i], view.row_bytes[i], view.rows[i],
+                                     cudaMemcpyHostToDevice, stream));
+    }
+  }
+
+  static size_t dtype_bytes(trt::DType dtype) {
+    switch (dtype) {
+      case trt::DType::HALF:
+        return sizeof(__half);
+      case trt::DType::INT8:
+      case trt::DType::UINT8:
+      case trt::DType::BOOL:
+        return 1;
+      default:
+        return 4;
+    }
+  }
+
+  // bytes of one image in the input binding at the run shape
+  size_t input_bytes() const {
+    return network_input_width_ * network_input_height_ * 3 * dtype_bytes(input_dtype_);
+  }
+
+  // floats per image in output_boxarray_ and candidate_boxes_ (at the run shape)
+  size_t boxarray_stride() const { return 32 + max_image_boxes_ * NUM_BOX_ELEMENT; }
+  size_t candidate_stride() const { return 32 + bbox_head_dims_[1] * NUM_BOX_ELEMENT; }
+
+  // The class table of options, if it has one, is written to table_host and copied to
+  // table_device on stream
+  DecodeParams make_decode_params(float confidence_threshold, float nms_threshold,
+                                  const DecodeOptions &options, float *table_host,
+                                  float *table_device, cudaStream_t stream) {
+    DecodeParams params;
+    params.lowest_threshold = confidence_threshold;
+    params.nms_threshold = nms_threshold;
+    params.class_agnostic = options.class_agnostic;
+    params.max_detections = options.max_detections;
+    params.max_per_class = options.max_per_class;
+
+    if (options.thresholds(num_classes_, confidence_threshold, table_host)) {
+      params.lowest_threshold = *std::min_element(table_host, table_host + num_classes_);
+      params.class_thresholds = table_device;
+      checkRuntime(cudaMemcpyAsync(table_device, table_host, num_classes_ * sizeof(float),
+                                   cudaMemcpyHostToDevice, stream));
+    }
+    return params;
+  }
+
+  // images without options take the parameters of the model
+  void resolve_decode_params(const Image *images, int num_image, cudaStream_t stream) {
+    vector<DecodeParams> &params = arena_.decode_params;
+    bool has_options = false;
+    for (int i = 0; i < num_image; ++i) has_options |= images[i].options != nullptr;
+    if (has_options) {
+      image_thresholds_.gpu(num_image * num_classes_);
+      image_thresholds_.cpu(num_image * num_classes_);
+    }
+
+    for (int i = 0; i < num_image; ++i) {
+      const ImageOptions *options = images[i].options.get();
+      if (options == nullptr) {
+        params[i] = default_params_;
+        continue;
+      }
+
+      float confidence_threshold = options->confidence_threshold >= 0
+                                       ? options->confidence_threshold
+                                       : confidence_threshold_;
+      float nms_threshold =
+          options->nms_threshold >= 0 ? options->nms_threshold : nms_threshold_;
+      params[i] = make_decode_params(confidence_threshold, nms_threshold, options->decode,
+                                     image_thresholds_.cpu() + i * num_classes_,
+                                     image_thresholds_.gpu() + i * num_classes_, stream);
+    }
+  }
+
+  // decode + top-k + nms of image ib, the head is read in its own dtype
+  void decode(int ib, float *affine_matrix_device, cudaStream_t stream) {
+    const DecodeParams &params = arena_.decode_params[ib];
+    float *boxarray_device = output_boxarray_.gpu() + ib * boxarray_stride();
+    float *candidates_device = candidate_boxes_.gpu() + ib * candidate_stride();
+    int *flags_device = nullptr;
+    if (ordered_decode_) {
+      flags_device = candidate_flags_.gpu() + ib * bbox_head_dims_[1];
+      checkRuntime(cudaMemsetAsync(flags_device, 0, bbox_head_dims_[1] * sizeof(int), stream));
+    } else {
+      checkRuntime(cudaMemsetAsync(candidates_device, 0, sizeof(int), stream));
+    }
+
+    size_t offset = (size_t)ib * bbox_head_dims_[1] * bbox_head_dims_[2];
+    if (bbox_dtype_ == trt::DType::HALF) {
+      decode_kernel_invoker((const __half *)bbox_predict_.gpu() + offset, bbox_head_dims_[1],
+                            num_classes_, bbox_head_dims_[2], params.lowest_threshold,
+                            params.class_thresholds, params.nms_threshold, params.class_agnostic,
+                            affine_matrix_device, candidates_device, flags_device,
+                            boxarray_device, max_image_boxes_, type_, stream);
+    } else {
+      decode_kernel_invoker((const float *)bbox_predict_.gpu() + offset, bbox_head_dims_[1],
+                            num_classes_, bbox_head_dims_[2], params.lowest_threshold,
+                            params.class_thresholds, params.nms_threshold, params.class_agnostic,
+                            affine_matrix_device, candidates_device, flags_device,
+                            boxarray_device, max_image_boxes_, type_, stream);
+    }
+  }
+
+  // mask of the box at row_index of image ib, weights and protos may be half independently
+  template <typename TWeight>
+  void decode_mask(const TWeight *mask_weights, int ib, float left, float top,
+                   unsigned char *mask_out, int out_width, int out_height, cudaStream_t stream) {
+    size_t offset =
+        (size_t)ib * segment_head_dims_[1] * segment_head_dims_[2] * segment_head_dims_[3];
+    if (segment_dtype_ == trt::DType::HALF) {
+      decode_single_mask(left, top, mask_weights, (const __half *)segment_predict_.gpu() + offset,
+                         segment_head_dims_[3], segment_head_dims_[2], mask_out,
+                         segment_head_dims_[1], out_width, out_height, stream);
+    } else {
+      decode_single_mask(left, top, mask_weights, (const float *)segment_predict_.gpu() + offset,
+                         segment_head_dims_[3], segment_head_dims_[2], mask_out,
+                         segment_head_dims_[1], out_width, out_height, stream);
+    }
+  }
+
+  void decode_mask(int ib, int row_index, float left, float top, unsigned char *mask_out,
+                   int out_width, int out_height, cudaStream_t stream) {
+    size_t offset = ((size_t)ib * bbox_head_dims_[1] + row_index) * bbox_head_dims_[2] +
+                    num_classes_ + 4;
+    if (bbox_dtype_ == trt::DType::HALF)
+      decode_mask((const __half *)bbox_predict_.gpu() + offset, ib, left, top, mask_out,
+                  out_width, out_height, stream);
+    else
+      decode_mask((const float *)bbox_predict_.gpu() + offset, ib, left, top, mask_out,
+                  out_width, out_height, stream);
+  }
+
+  // device part of preprocess, only stream operations so that it can be captured
+  void preprocess(int ibatch, const Image &image,
+                  const shared_ptr<trt::Memory<unsigned char>> &preprocess_buffer,
+                  cudaStream_t stream) {
+    uint8_t *input_device = input_buffer_.gpu() + ibatch * input_bytes();
+    size_t size_matrix = upbound(sizeof(AffineMatrix::d2i), 32);
+    uint8_t *gpu_workspace = preprocess_buffer->gpu();
+    float *affine_matrix_device = (float *)gpu_workspace;
+    PlaneView image_device = packed_view(plane_view(image), gpu_workspace + size_matrix);
+
+    float *affine_matrix_host = (float *)preprocess_buffer->cpu();
+
+    // the decoder reads the matrix from device memory, the preprocess gets it by value
+    checkRuntime(cudaMemcpyAsync(affine_matrix_device, affine_matrix_host,
+                                 sizeof(AffineMatrix::d2i), cudaMemcpyHostToDevice, stream));
+
+    // written in the binding's own dtype, no conversion layer in the engine
+    switch (input_dtype_) {
+      case trt::DType::HALF:
+        warp_affine_normalize_plane(image_device, (__half *)input_device, network_input_width_,
+                                    network_input_height_, affine_matrix_host, 114, normalize_,
+                                    interp_, 1.0f, stream);
+        break;
+      case trt::DType::INT8:
+        warp_affine_normalize_plane(image_device, (int8_t *)input_device, network_input_width_,
+                                    network_input_height_, affine_matrix_host, 114, normalize_,
+                                    interp_, input_int8_scale_, stream);
+        break;
+      case trt::DType::UINT8:
+        warp_affine_normalize_plane(image_device, input_device, network_input_width_,
+                                    network_input_height_, affine_matrix_host, 114, normalize_,
+                                    interp_, 1.0f, stream);
+        break;
+      default:
+        warp_affine_normalize_plane(image_device, (float *)input_device, network_input_width_,
+                                    network_input_height_, affine_matrix_host, 114, normalize_,
+                                    interp_, 1.0f, stream);
+        break;
+    }
+  }
+
+  // preprocess -> enqueue -> decode -> nms -> copy back, everything stays on the stream
+  bool enqueue(const Image *images, int num_image, cudaStream_t stream) {
+    for (int i = 0; i < num_image; ++i) preprocess(i, images[i], preprocess_buffers_[i], stream);
+
+    vector<void *> &bindings = arena_.bindings;
+    bindings.clear();
+    bindings.push_back(input_buffer_.gpu());
+    if (has_segment_) bindings.push_back(segment_predict_.gpu());
+    bindings.push_back(bbox_predict_.gpu());
+
+    if (!trt_->forward(bindings, stream)) {
+      INFO("Failed to tensorRT forward.");
+      return false;
+    }
+
+    for (int ib = 0; ib < num_image; ++ib)
+      decode(ib, (float *)preprocess_buffers_[ib]->gpu(), stream);
+
+    checkRuntime(cudaMemcpyAsync(output_boxarray_.cpu(), output_boxarray_.gpu(),
+                                 num_image * boxarray_stride() * sizeof(float),
+                                 cudaMemcpyDeviceToHost, stream));
+    return true;
+  }
+
+  // replay the graph of this batch/resolution, capture it if this is the first time
+  bool enqueue_graph(const Image *images, int num_image, cudaStream_t stream) {
+    struct Runner : public graph::Runner<CudaGraph> {
+      InferImpl *impl;
+      const Image *images;
+      int num_image;
+      cudaStream_t stream;
+
+      virtual bool eager() override { return impl->enqueue(images, num_image, stream); }
+
+      virtual shared_ptr<CudaGraph> capture() override {
+        auto graph = make_shared<CudaGraph>();
+        checkRuntime(cudaStreamBeginCapture(stream, cudaStreamCaptureModeThreadLocal));
+        bool captured = impl->enqueue(images, num_image, stream);
+        cudaError_t code = cudaStreamEndCapture(stream, &graph->graph);
+        if (captured && code == cudaSuccess) {
+          checkRuntime(cudaGraphInstantiate(&graph->exec, graph->graph, nullptr, nullptr, 0));
+          return graph;
+        }
+
+        // the cache remembers the failure, this shape keeps running eagerly
+        INFO("Failed to capture cuda graph for batch %d, %dx%d, code = %s", num_image,
+             images[0].width, images[0].height, cudaGetErrorName(code));
+        cudaGetLastError();
+        return nullptr;
+      }
+
+      virtual void replay(const CudaGraph &graph) override {
+        checkRuntime(cudaGraphLaunch(graph.exec, stream));
+      }
+    } runner;
+    runner.impl = this;
+    runner.images = images;
+    runner.num_image = num_image;
+    runner.stream = stream;
+    return graphs_.run(images, num_image, runner);
   }
 
-  bool load(const string &engine_file, Type type, float confidence_threshold, float nms_threshold) {
+  virtual void set_cuda_graph(bool enable, int max_graphs) override {
+    graphs_.set_capacity(enable ? max_graphs : 0);
+
+    // the legacy default stream can not be captured
+    if (graphs_.enabled() && graph_stream_ == nullptr)
+      checkRuntime(cudaStreamCreate(&graph_stream_));
+  }
+
+  virtual bool warmup(int max_batch, const vector<tuple<int, int>> &resolutions,
+                      void *stream) override {
+    int static_batch = trt_->static_dims(0)[0];
+    if (!isdynamic_model_) max_batch = static_batch;
+    if (max_batch <= 0) return false;
+
+    vector<tuple<int, int>> sizes = resolutions;
+    if (sizes.empty()) sizes.emplace_back(network_input_width_, network_input_height_);
+
+    size_t max_image_bytes = 0;
+    for (auto &size : sizes)
+      max_image_bytes = std::max(max_image_bytes, (size_t)get<0>(size) * get<1>(size) * 3);
+
+    // reserve everything at the largest size first, so smaller batches never reallocate
+    adjust_memory(max_batch);
+    size_t size_matrix = upbound(sizeof(AffineMatrix::d2i), 32);
+    for (int i = 0; i < max_batch; ++i) {
+      preprocess_buffers_[i]->gpu(size_matrix + max_image_bytes);
+      preprocess_buffers_[i]->cpu(size_matrix + max_image_bytes);
+    }
+
+    // the scratch of the boxes, the class tables of per image options and the mask of the largest
+    // possible box, the dummy passes below reach none of them
+    arena_.reserve(max_batch, max_image_boxes_, num_classes_);
+    image_thresholds_.gpu(max_batch * num_classes_);
+    image_thresholds_.cpu(max_batch * num_classes_);
+    if (has_segment_) {
+      if (box_segment_cache_.empty())
+        box_segment_cache_.push_back(std::make_shared<trt::Memory<unsigned char>>());
+      box_segment_cache_[0]->gpu(max_segment_dims_[2] * max_segment_dims_[3]);
+    }
+
+    // one dummy pass per batch size lets TensorRT do its lazy setup for every shape
+    vector<uint8_t> dummy(max_image_bytes, 114);
+    trt::Timer timer;
+    timer.start(stream);
+    for (auto &size : sizes) {
+      Image image(dummy.data(), get<0>(size), get<1>(size));
+      for (int batch = isdynamic_model_ ? 1 : max_batch; batch <= max_batch; ++batch) {
+        if (forwards(vector<Image>(batch, image), stream).size() != (size_t)batch) {
+          INFO("Warmup failed at batch %d, %dx%d", batch, get<0>(size), get<1>(size));
+          return false;
+        }
+      }
+    }
+    timer.stop("Warmup");
+    return true;
+  }
+
+  virtual shared_ptr<unsigned char> lease_image_buffer(size_t bytes) override {
+    return pinned_pool_->lease(bytes);
+  }
+
+  virtual bool register_host_memory(void *ptr, size_t bytes) override {
+    return pinned_pool_->register_memory(ptr, bytes);
+  }
+
+  virtual void unregister_host_memory(void *ptr) override {
+    pinned_pool_->unregister_memory(ptr);
+  }
+
+  virtual void set_max_image_boxes(int max_boxes) override {
+    if (max_boxes <= 0) {
+      INFO("Invalid max image boxes %d", max_boxes);
+      return;
+    }
+
+    // k is a kernel argument of the captured graphs
+    max_image_boxes_ = max_boxes;
+    graphs_.clear();
+  }
+
+  // opt shape of the profile, in rect mode the smallest multiple of 32 holding every image
+  void select_input_shape(const Image *images, int num_image, int &width, int &height) const {
+    width = target_width_;
+    height = target_height_;
+    if (!rect_input_) return;
+
+    width = height = 0;
+    for (int i = 0; i < num_image; ++i) {
+      auto size = rect_input_size(images[i].width, images[i].height, target_width_,
+                                  target_height_);
+      width = std::max(width, get<0>(size));
+      height = std::max(height, get<1>(size));
+    }
+    width = std::min(std::max(width, min_input_width_), max_input_width_);
+    height = std::min(std::max(height, min_input_height_), max_input_height_);
+  }
+
+  // run dims of the input binding, the head dims follow it
+  bool set_input_shape(int batch, int width, int height) {
+    if (batch == run_batch_size_ && width == network_input_width_ &&
+        height == network_input_height_)
+      return true;
+
+    vector<int> &input_dims = arena_.input_dims;
+    input_dims = static_input_dims_;
+    input_dims[0] = batch;
+    input_dims[height_axis_] = height;
+    input_dims[width_axis_] = width;
+    if (!trt_->set_run_dims(0, input_dims)) {
+      INFO("Failed to set the input shape %s", trt::format_shape(input_dims).c_str());
+      return false;
+    }
+
+    run_batch_size_ = batch;
+    network_input_width_ = width;
+    network_input_height_ = height;
+    if (dynamic_hw_) {
+      bbox_head_dims_ = trt_->run_dims(bbox_binding_);
+      if (has_segment_) segment_head_dims_ = trt_->run_dims(1);
+    }
+    return true;
+  }
+
+  virtual void set_rect_input(bool enable) override {
+    if (enable && !dynamic_hw_) {
+      INFO("Rect input needs an engine with dynamic height and width");
+      return;
+    }
+
+    // the shape is derived from the image size, which the graphs are keyed by
+    rect_input_ = enable;
+    graphs_.clear();
+  }
+
+  virtual void set_ordered_decode(bool enable) override {
+    ordered_decode_ = enable;
+    graphs_.clear();
+  }
+
+  virtual void set_decode_options(const DecodeOptions &options) override {
+    if (!options.class_thresholds.empty() && (int)options.class_thresholds.size() != num_classes_) {
+      INFO("Expect %d class thresholds, got %d", num_classes_,
+           (int)options.class_thresholds.size());
+      return;
+    }
+    for (int label : options.classes) {
+      if (label < 0 || label >= num_classes_) {
+        INFO("Invalid class %d, the model has %d classes", label, num_classes_);
+        return;
+      }
+    }
+
+    default_params_ = make_decode_params(confidence_threshold_, nms_threshold_, options,
+                                         class_thresholds_.cpu(num_classes_),
+                                         class_thresholds_.gpu(num_classes_), nullptr);
+    checkRuntime(cudaStreamSynchronize(nullptr));
+
+    // thresholds and the nms mode are kernel arguments of the captured graphs
+    graphs_.clear();
+  }
+
+  virtual void set_input_int8_scale(float scale) override {
+    if (scale <= 0) {
+      INFO("Invalid int8 input scale %f", scale);
+      return;
+    }
+
+    // the scale is baked into the captured preprocess
+    input_int8_scale_ = scale;
+    graphs_.clear();
+  }
+
+  bool load(const string &engine_file, Type type, float confidence_threshold, float nms_threshold,
+            Interp interp) {
     trt_ = trt::load(engine_file);
     if (trt_ == nullptr) return false;
 
+    pinned_pool_ = trt::create_pinned_pool();
+
     trt_->print();
 
     this->type_ = type;
     this->confidence_threshold_ = confidence_threshold;
     this->nms_threshold_ = nms_threshold;
+    this->default_params_.lowest_threshold = confidence_threshold;
+    this->default_params_.nms_threshold = nms_threshold;
+    this->interp_ = interp;
 
     auto input_dim = trt_->static_dims(0);
-    bbox_head_dims_ = trt_->static_dims(1);
+    static_input_dims_ = input_dim;
     has_segment_ = type == Type::V8Seg;
-    if (has_segment_) {
-      bbox_head_dims_ = trt_->static_dims(2);
-      segment_head_dims_ = trt_->static_dims(1);
+    bbox_binding_ = has_segment_ ? 2 : 1;
+    input_dtype_ = trt_->dtype(0);
+    if (input_dtype_ == trt::DType::UINT8) {
+      // raw pixels in NHWC, the engine normalizes by itself
+      height_axis_ = 1;
+      width_axis_ = 2;
+    } else if (input_dtype_ == trt::DType::FLOAT || input_dtype_ == trt::DType::HALF ||
+               input_dtype_ == trt::DType::INT8) {
+      height_axis_ = 2;
+      width_axis_ = 3;
+    } else {
+      INFO("Unsupport input dtype %d", (int)input_dtype_);
+      return false;
+    }
+    isdynamic_model_ = input_dim[0] == -1;
+    dynamic_hw_ = input_dim[height_axis_] == -1 || input_dim[width_axis_] == -1;
+
+    max_bbox_dims_ = trt_->static_dims(bbox_binding_);
+    if (has_segment_) max_segment_dims_ = trt_->static_dims(1);
+    if (dynamic_hw_) {
+      // run at the opt shape by default, the buffers are sized for the max one
+      auto opt_dims = trt_->profile_dims(0, trt::Profile::Opt);
+      auto min_dims = trt_->profile_dims(0, trt::Profile::Min);
+      auto max_dims = trt_->profile_dims(0, trt::Profile::Max);
+      target_width_ = opt_dims[width_axis_];
+      target_height_ = opt_dims[height_axis_];
+      min_input_width_ = min_dims[width_axis_];
+      min_input_height_ = min_dims[height_axis_];
+      max_input_width_ = max_dims[width_axis_];
+      max_input_height_ = max_dims[height_axis_];
+      if (!trt_->set_run_dims(0, max_dims)) {
+        INFO("Failed to set the max input shape %s", trt::format_shape(max_dims).c_str());
+        return false;
+      }
+      max_bbox_dims_ = trt_->run_dims(bbox_binding_);
+      if (has_segment_) max_segment_dims_ = trt_->run_dims(1);
+    } else {
+      target_width_ = min_input_width_ = max_input_width_ = input_dim[width_axis_];
+      target_height_ = min_input_height_ = max_input_height_ = input_dim[height_axis_];
+    }
+    network_input_width_ = target_width_;
+    network_input_height_ = target_height_;
+    bbox_head_dims_ = max_bbox_dims_;
+    segment_head_dims_ = max_segment_dims_;
+
+    // fp16 heads are decoded as they are, without a cast layer in the engine
+    bbox_dtype_ = trt_->dtype(has_segment_ ? 2 : 1);
+    segment_dtype_ = has_segment_ ? trt_->dtype(1) : trt::DType::FLOAT;
+    for (trt::DType dtype : {bbox_dtype_, segment_dtype_}) {
+      if (dtype != trt::DType::FLOAT && dtype != trt::DType::HALF) {
+        INFO("Unsupport output dtype %d", (int)dtype);
+        return false;
+      }
     }
-    network_input_width_ = input_dim[3];
-    network_input_height_ = input_dim[2];
-    isdynamic_model_ = trt_->has_dynamic_dim();
 
     if (type == Type::V5 || type == Type::V3 || type == Type::V7) {
       normalize_ = Norm::alpha_beta(1 / 255.0f, 0.0f, ChannelType::SwapRB);
@@ -553,142 +1289,143 @@ class InferImpl : public Infer {
     } else {
       INFO("Unsupport type %d", type);
     }
+
+    if (input_dtype_ == trt::DType::UINT8) {
+      ChannelType channel_type = normalize_.channel_type;
+      normalize_ = Norm::None();
+      normalize_.channel_type = channel_type;
+    }
     return true;
   }
 
   virtual BoxArray forward(const Image &image, void *stream = nullptr) override {
-    auto output = forwards({image}, stream);
-    if (output.empty()) return {};
-    return output[0];
+    BoxArray output;
+    if (!forwards_into(&image, 1, &output, stream)) return {};
+    return output;
   }
 
   virtual vector<BoxArray> forwards(const vector<Image> &images, void *stream = nullptr) override {
-    int num_image = images.size();
-    if (num_image == 0) return {};
-
-    auto input_dims = trt_->static_dims(0);
-    int infer_batch_size = input_dims[0];
-    if (infer_batch_size != num_image) {
-      if (isdynamic_model_) {
-        infer_batch_size = num_image;
-        input_dims[0] = num_image;
-        if (!trt_->set_run_dims(0, input_dims)) return {};
-      } else {
-        if (infer_batch_size < num_image) {
-          INFO(
-              "When using static shape model, number of images[%d] must be "
-              "less than or equal to the maximum batch[%d].",
-              num_image, infer_batch_size);
-          return {};
-        }
-      }
-    }
-    adjust_memory(infer_batch_size);
+    if (images.empty()) return {};
 
-    vector<AffineMatrix> affine_matrixs(num_image);
-    cudaStream_t stream_ = (cudaStream_t)stream;
-    for (int i = 0; i < num_image; ++i)
-      preprocess(i, images[i], preprocess_buffers_[i], affine_matrixs[i], stream);
+    vector<BoxArray> arrout(images.size());
+    if (!forwards_into(images.data(), images.size(), arrout.data(), stream)) return {};
+    return arrout;
+  }
 
-    float *bbox_output_device = bbox_predict_.gpu();
-    vector<void *> bindings{input_buffer_.gpu(), bbox_output_device};
+  virtual bool forwards_into(const vector<Image> &images, BoxArray *out,
+                             void *stream = nullptr) override {
+    return forwards_into(images.data(), images.size(), out, stream);
+  }
 
-    if (has_segment_) {
-      bindings = {input_buffer_.gpu(), segment_predict_.gpu(), bbox_output_device};
+  bool forwards_into(const Image *images, int num_image, BoxArray *out, void *stream) {
+    if (num_image == 0) return true;
+
+    int infer_batch_size = static_input_dims_[0];
+    if (isdynamic_model_) {
+      infer_batch_size = num_image;
+    } else if (infer_batch_size < num_image) {
+      INFO(
+          "When using static shape model, number of images[%d] must be "
+          "less than or equal to the maximum batch[%d].",
+          num_image, infer_batch_size);
+      return false;
     }
 
-    if (!trt_->forward(bindings, stream)) {
-      INFO("Failed to tensorRT forward.");
-      return {};
+    if (isdynamic_model_ || dynamic_hw_) {
+      int input_width, input_height;
+      select_input_shape(images, num_image, input_width, input_height);
+      if (!set_input_shape(infer_batch_size, input_width, input_height)) return false;
     }
+    adjust_memory(infer_batch_size);
+
+    bool use_graph = graphs_.usable(images, num_image);
+    cudaStream_t stream_ = (cudaStream_t)stream;
+    if (use_graph && stream_ == nullptr) stream_ = graph_stream_;
+
+    arena_.reset(num_image);
+    vector<AffineMatrix> &affine_matrixs = arena_.affine_matrixs;
+    for (int i = 0; i < num_image; ++i)
+      stage(images[i], preprocess_buffers_[i], affine_matrixs[i], stream_);
+    resolve_decode_params(images, num_image, stream_);
+
+    bool ok = use_graph ? enqueue_graph(images, num_image, stream_)
+                        : enqueue(images, num_image, stream_);
+    if (!ok) return false;
 
-    for (int ib = 0; ib < num_image; ++ib) {
-      float *boxarray_device =
-          output_boxarray_.gpu() + ib * (32 + MAX_IMAGE_BOXES * NUM_BOX_ELEMENT);
-      float *affine_matrix_device = (float *)preprocess_buffers_[ib]->gpu();
-      float *image_based_bbox_output =
-          bbox_output_device + ib * (bbox_head_dims_[1] * bbox_head_dims_[2]);
-      checkRuntime(cudaMemsetAsync(boxarray_device, 0, sizeof(int), stream_));
-      decode_kernel_invoker(image_based_bbox_output, bbox_head_dims_[1], num_classes_,
-                            bbox_head_dims_[2], confidence_threshold_, nms_threshold_,
-                            affine_matrix_device, boxarray_device, MAX_IMAGE_BOXES, type_, stream_);
-    }
-    checkRuntime(cudaMemcpyAsync(output_boxarray_.cpu(), output_boxarray_.gpu(),
-                                 output_boxarray_.gpu_bytes(), cudaMemcpyDeviceToHost, stream_));
     checkRuntime(cudaStreamSynchronize(stream_));
 
-    vector<BoxArray> arrout(num_image);
     int imemory = 0;
+    vector<int> &row_indices = arena_.row_indices;
+    vector<int> *kept = has_segment_ ? &arena_.kept : nullptr;
     for (int ib = 0; ib < num_image; ++ib) {
-      float *parray = output_boxarray_.cpu() + ib * (32 + MAX_IMAGE_BOXES * NUM_BOX_ELEMENT);
-      int count = min(MAX_IMAGE_BOXES, (int)*parray);
-      BoxArray &output = arrout[ib];
+      float *parray = output_boxarray_.cpu() + ib * boxarray_stride();
+      int count = min(max_image_boxes_, (int)*parray);
+      BoxArray &output = out[ib];
+      output.clear();
       output.reserve(count);
+      row_indices.clear();
       for (int i = 0; i < count; ++i) {
         float *pbox = parray + 1 + i * NUM_BOX_ELEMENT;
         int label = pbox[5];
         int keepflag = pbox[6];
         if (keepflag == 1) {
-          Box result_object_box(pbox[0], pbox[1], pbox[2], pbox[3], pbox[4], label);
-          if (has_segment_) {
-            int row_index = pbox[7];
-            int mask_dim = segment_head_dims_[1];
-            float *mask_weights = bbox_output_device +
-                                  (ib * bbox_head_dims_[1] + row_index) * bbox_head_dims_[2] +
-                                  num_classes_ + 4;
-
-            float *mask_head_predict = segment_predict_.gpu();
-            float left, top, right, bottom;
-            float *i2d = affine_matrixs[ib].i2d;
-            affine_project(i2d, pbox[0], pbox[1], &left, &top);
-            affine_project(i2d, pbox[2], pbox[3], &right, &bottom);
-
-            float box_width = right - left;
-            float box_height = bottom - top;
-
-            float scale_to_predict_x = segment_head_dims_[3] / (float)network_input_width_;
-            float scale_to_predict_y = segment_head_dims_[2] / (float)network_input_height_;
-            int mask_out_width = box_width * scale_to_predict_x + 0.5f;
-            int mask_out_height = box_height * scale_to_predict_y + 0.5f;
-
-            if (mask_out_width > 0 && mask_out_height > 0) {
-              if (imemory >= (int)box_segment_cache_.size()) {
-                box_segment_cache_.push_back(std::make_shared<trt::Memory<unsigned char>>());
-              }
-
-              int bytes_of_mask_out = mask_out_width * mask_out_height;
-              auto box_segment_output_memory = box_segment_cache_[imemory];
-              result_object_box.seg =
-                  make_shared<InstanceSegmentMap>(mask_out_width, mask_out_height);
-
-              unsigned char *mask_out_device = box_segment_output_memory->gpu(bytes_of_mask_out);
-              unsigned char *mask_out_host = result_object_box.seg->data;
-              decode_single_mask(left * scale_to_predict_x, top * scale_to_predict_y, mask_weights,
-                                 mask_head_predict + ib * segment_head_dims_[1] *
-                                                         segment_head_dims_[2] *
-                                                         segment_head_dims_[3],
-                                 segment_head_dims_[3], segment_head_dims_[2], mask_out_device,
-                                 mask_dim, mask_out_width, mask_out_height, stream_);
-              checkRuntime(cudaMemcpyAsync(mask_out_host, mask_out_device,
-                                           box_segment_output_memory->gpu_bytes(),
-                                           cudaMemcpyDeviceToHost, stream_));
-            }
+          output.emplace_back(pbox[0], pbox[1], pbox[2], pbox[3], pbox[4], label);
+          if (has_segment_) row_indices.push_back(pbox[7]);
+        }
+      }
+
+      // the caps go before the masks, dropped boxes cost no mask decode
+      const DecodeParams &params = arena_.decode_params[ib];
+      cpu::limit_detections(output, params.max_detections, params.max_per_class, kept,
+                            &arena_.limit);
+      if (!has_segment_) continue;
+
+      for (size_t i = 0; i < output.size(); ++i) {
+        Box &result_object_box = output[i];
+        int row_index = row_indices[(*kept)[i]];
+        float left, top, right, bottom;
+        float *i2d = affine_matrixs[ib].i2d;
+        affine_project(i2d, result_object_box.left, result_object_box.top, &left, &top);
+        affine_project(i2d, result_object_box.right, result_object_box.bottom, &right, &bottom);
+
+        float box_width = right - left;
+        float box_height = bottom - top;
+
+        float scale_to_predict_x = segment_head_dims_[3] / (float)network_input_width_;
+        float scale_to_predict_y = segment_head_dims_[2] / (float)network_input_height_;
+        int mask_out_width = box_width * scale_to_predict_x + 0.5f;
+        int mask_out_height = box_height * scale_to_predict_y + 0.5f;
+
+        if (mask_out_width > 0 && mask_out_height > 0) {
+          if (imemory >= (int)box_segment_cache_.size()) {
+            box_segment_cache_.push_back(std::make_shared<trt::Memory<unsigned char>>());
           }
-          output.emplace_back(result_object_box);
+
+          int bytes_of_mask_out = mask_out_width * mask_out_height;
+          auto &box_segment_output_memory = box_segment_cache_[imemory];
+          result_object_box.seg = make_shared<InstanceSegmentMap>(mask_out_width, mask_out_height);
+
+          unsigned char *mask_out_device = box_segment_output_memory->gpu(bytes_of_mask_out);
+          unsigned char *mask_out_host = result_object_box.seg->data;
+          decode_mask(ib, row_index, left * scale_to_predict_x, top * scale_to_predict_y,
+                      mask_out_device, mask_out_width, mask_out_height, stream_);
+          checkRuntime(cudaMemcpyAsync(mask_out_host, mask_out_device,
+                                       box_segment_output_memory->gpu_bytes(),
+                                       cudaMemcpyDeviceToHost, stream_));
         }
       }
     }
 
     if (has_segment_) checkRuntime(cudaStreamSynchronize(stream_));
 
-    return arrout;
+    return true;
   }
 };
 
 Infer *loadraw(const std::string &engine_file, Type type, float confidence_threshold,
-               float nms_threshold) {
+               float nms_threshold, Interp interp) {
   InferImpl *impl = new InferImpl();
-  if (!impl->load(engine_file, type, confidence_threshold, nms_threshold)) {
+  if (!impl->load(engine_file, type, confidence_threshold, nms_threshold, interp)) {
     delete impl;
     impl = nullptr;
   }
@@ -696,9 +1433,9 @@ Infer *loadraw(const std::string &engine_file, Type type, float confidence_thres
 }
 
 shared_ptr<Infer> load(const string &engine_file, Type type, float confidence_threshold,
-                       float nms_threshold) {
+                       float nms_threshold, Interp interp) {
   return std::shared_ptr<InferImpl>(
-      (InferImpl *)loadraw(engine_file, type, confidence_threshold, nms_threshold));
+      (InferImpl *)loadraw(engine_file, type, confidence_threshold, nms_threshold, interp));
 }
 
 std::tuple<uint8_t, uint8_t, uint8_t> hsv2bgr(float h, float s, float v) {
@@ -1,9 +1,11 @@
 #ifndef __YOLO_HPP__
 #define __YOLO_HPP__
 
+#include <algorithm>
 #include <future>
 #include <memory>
 #include <string>
+#include <tuple>
 #include <vector>
 
 namespace yolo {
@@ -40,29 +42,273 @@ struct Box {
         class_label(class_label) {}
 };
 
+// Filters of the decode and nms, the defaults change nothing.
+struct DecodeOptions {
+  // nms across classes, a box suppresses overlapping boxes of any class
+  bool class_agnostic = false;
+
+  // confidence threshold per class (empty, or one per class), replaces the global one
+  std::vector<float> class_thresholds;
+
+  // only these classes are decoded, the others never reach nms (empty = all)
+  std::vector<int> classes;
+
+  // after nms keep the most confident boxes, per image and per class (0 = no limit)
+  int max_detections = 0;
+  int max_per_class = 0;
+
+  // Writes the threshold of every class to table[num_classes], infinity for the classes left
+  // out. False, and table untouched, when all of them use confidence_threshold.
+  bool thresholds(int num_classes, float confidence_threshold, float *table) const;
+};
+
+// Thresholds and filters of one request, they replace the ones of the model for that image only.
+// Images with different options still share one batch.
+struct ImageOptions {
+  float confidence_threshold = -1;  // < 0 keeps the one given to load
+  float nms_threshold = -1;
+  DecodeOptions decode;
+};
+
+enum class PixelFormat : int {
+  BGR = 0,   // packed bgr, 3 bytes per pixel
+  NV12 = 1,  // Y plane, then interleaved UV plane at half resolution
+  I420 = 2,  // Y plane, then U and V planes at half resolution
+  YUYV = 3   // packed Y0 U Y1 V, 2 bytes per pixel
+};
+
 struct Image {
-  const void *bgrptr = nullptr;
+  const void *bgrptr = nullptr;  // the pixels, or the Y plane of NV12/I420
   int width = 0, height = 0;
+  int stride = 0;  // bytes per row of bgrptr, 0 means packed
+  PixelFormat format = PixelFormat::BGR;
+
+  // NV12: the UV plane, I420: the U and V planes, their stride is stride (NV12) or stride / 2
+  // (I420). nullptr means the plane follows the previous one.
+  const void *uptr = nullptr;
+  const void *vptr = nullptr;
+
+  // per request thresholds and filters, nullptr = the ones of the model
+  std::shared_ptr<const ImageOptions> options;
 
   Image() = default;
-  Image(const void *bgrptr, int width, int height) : bgrptr(bgrptr), width(width), height(height) {}
+  Image(const void *bgrptr, int width, int height, int stride = 0)
+      : bgrptr(bgrptr), width(width), height(height), stride(stride) {}
+
+  // 4:2:0 formats need even width and height
+  static Image nv12(const void *y, const void *uv, int width, int height, int stride = 0);
+  static Image i420(const void *y, const void *u, const void *v, int width, int height,
+                    int stride = 0);
+  static Image yuyv(const void *data, int width, int height, int stride = 0);
+
+  // bytes per row of the first plane
+  int line_size() const;
+
+  // Sub-image view sharing the same memory, nothing is copied. Boxes detected on it are in the
+  // coordinates of the crop. For YUV formats x and y are rounded down to even.
+  Image crop(int x, int y, int w, int h) const;
 };
 
 typedef std::vector<Box> BoxArray;
 
+enum class NormType : int { None = 0, MeanStd = 1, AlphaBeta = 2 };
+
+// Resize of the preprocess. Bilinear matches cv::INTER_LINEAR, Area averages the source pixels
+// under each dst pixel (less aliasing when shrinking large frames), Nearest is the cheapest.
+enum class Interp : int { Bilinear = 0, Nearest = 1, Area = 2 };
+
+enum class ChannelType : int { None = 0, SwapRB = 1 };
+
+/* 归一化操作，可以支持均值标准差，alpha beta，和swap RB */
+struct Norm {
+  float mean[3];
+  float std[3];
+  float alpha, beta;
+  NormType type = NormType::None;
+  ChannelType channel_type = ChannelType::None;
+
+  // out = (x * alpha - mean) / std
+  static Norm mean_std(const float mean[3], const float std[3], float alpha = 1 / 255.0f,
+                       ChannelType channel_type = ChannelType::None);
+
+  // out = x * alpha + beta
+  static Norm alpha_beta(float alpha, float beta = 0, ChannelType channel_type = ChannelType::None);
+
+  // None
+  static Norm None();
+};
+
+struct AffineMatrix {
+  float i2d[6];  // image to dst(network), 2x3 matrix
+  float d2i[6];  // dst to image, 2x3 matrix
+
+  void compute(const std::tuple<int, int> &from, const std::tuple<int, int> &to) {
+    float scale_x = std::get<0>(to) / (float)std::get<0>(from);
+    float scale_y = std::get<1>(to) / (float)std::get<1>(from);
+    float scale = std::min(scale_x, scale_y);
+    i2d[0] = scale;
+    i2d[1] = 0;
+    i2d[2] = -scale * std::get<0>(from) * 0.5 + std::get<0>(to) * 0.5 + scale * 0.5 - 0.5;
+    i2d[3] = 0;
+    i2d[4] = scale;
+    i2d[5] = -scale * std::get<1>(from) * 0.5 + std::get<1>(to) * 0.5 + scale * 0.5 - 0.5;
+
+    double D = i2d[0] * i2d[4] - i2d[1] * i2d[3];
+    D = D != 0. ? double(1.) / D : double(0.);
+    double A11 = i2d[4] * D, A22 = i2d[0] * D, A12 = -i2d[1] * D, A21 = -i2d[3] * D;
+    double b1 = -A11 * i2d[2] - A12 * i2d[5];
+    double b2 = -A21 * i2d[2] - A22 * i2d[5];
+
+    d2i[0] = A11;
+    d2i[1] = A12;
+    d2i[2] = b1;
+    d2i[3] = A21;
+    d2i[4] = A22;
+    d2i[5] = b2;
+  }
+};
+
+// Minimal padding input of a dynamic height/width engine: the image scaled as the letterbox into
+// target, rounded up to a multiple of align. A 1920x1080 frame and a 640x640 target give 640x384.
+std::tuple<int, int> rect_input_size(int width, int height, int target_width, int target_height,
+                                     int align = 32);
+
 // [Preprocess]: 0.50736 ms
 // [Forward]: 3.96410 ms
 // [BoxDecode]: 0.12016 ms
 // [SegmentDecode]: 0.15610 ms
 class Infer {
  public:
+  // the returned BoxArrays are new, every call allocates them (see forwards_into)
   virtual BoxArray forward(const Image &image, void *stream = nullptr) = 0;
   virtual std::vector<BoxArray> forwards(const std::vector<Image> &images,
                                          void *stream = nullptr) = 0;
+
+  // Same as forwards, but writes into out[0 .. images.size()), reusing the storage of the given
+  // BoxArrays. After warmup, and once the given BoxArrays have held as many boxes, a detection
+  // model runs this without any heap allocation: the per call scratch lives in the model.
+  virtual bool forwards_into(const std::vector<Image> &images, BoxArray *out,
+                             void *stream = nullptr) = 0;
+
+  // Opt-in: capture preprocess->forward->decode->nms into a cuda graph per (batch size, image
+  // resolution) and replay it, keeping at most max_graphs of them (least recently used evicted).
+  // Batches with mixed image resolutions run without graph.
+  virtual void set_cuda_graph(bool enable, int max_graphs = 8) = 0;
+
+  // Page-locked buffer leased from the model, decode frames straight into it. Images whose pixels
+  // live in a leased or registered buffer are uploaded without the staging memcpy. The buffer is
+  // recycled once the last reference is dropped.
+  virtual std::shared_ptr<unsigned char> lease_image_buffer(size_t bytes) = 0;
+
+  // Page-lock caller memory (cudaHostRegister) for the same zero-copy upload.
+  virtual bool register_host_memory(void *ptr, size_t bytes) = 0;
+  virtual void unregister_host_memory(void *ptr) = 0;
+
+  // Boxes per image that go into nms (default 1024). When more pass the confidence threshold the
+  // ones with the highest confidence are kept, the output buffers are sized from it.
+  virtual void set_max_image_boxes(int max_boxes) = 0;
+
+  // Ordered decode: candidates are packed in anchor order with prefix sums instead of atomics,
+  // so the same frame gives byte-identical boxes on every run, the same as cpu::decode_boxes.
+  virtual void set_ordered_decode(bool enable) = 0;
+
+  // Class-agnostic nms, per class thresholds, class whitelist and detection caps
+  virtual void set_decode_options(const DecodeOptions &options) = 0;
+
+  // Engines built with dynamic height/width: each batch runs at the smallest multiple of 32 that
+  // holds its images letterboxed into the opt shape of the profile (rect_input_size, clamped to
+  // the profile), instead of the opt shape itself. Batches of one shape bucket pad the least.
+  virtual void set_rect_input(bool enable) = 0;
+
+  // Engines with an int8 input binding take round(x / scale), scale being the dynamic range of
+  // the input divided by 127. The default 1/127 fits inputs normalized to [0, 1]. Half and uint8
+  // (NHWC, raw pixels) inputs are written without any scale.
+  virtual void set_input_int8_scale(float scale) = 0;
+
+  // Reserve every buffer for max_batch images of the largest resolution (width, height) and run
+  // a dummy pass for each batch size, so the first real request of any size pays no setup cost.
+  // An empty resolutions list means images of the network input size.
+  virtual bool warmup(int max_batch, const std::vector<std::tuple<int, int>> &resolutions = {},
+                      void *stream = nullptr) = 0;
 };
 
 std::shared_ptr<Infer> load(const std::string &engine_file, Type type,
-                            float confidence_threshold = 0.25f, float nms_threshold = 0.5f);
+                            float confidence_threshold = 0.25f, float nms_threshold = 0.5f,
+                            Interp interp = Interp::Bilinear);
+
+namespace cpu {
+
+// Host version of the cuda preprocess: sample the image through matrix_2_3 (dst -> image) with
+// the given interpolation, pad with const_value, normalize and write planar [3, height, width].
+void warp_affine_and_normalize_plane(const Image &image, float *dst, int dst_width,
+                                     int dst_height, const float *matrix_2_3, uint8_t const_value,
+                                     const Norm &norm, Interp interp);
+
+void warp_affine_bilinear_and_normalize_plane(const Image &image, float *dst, int dst_width,
+                                              int dst_height, const float *matrix_2_3,
+                                              uint8_t const_value, const Norm &norm);
+
+// Raw pixels [height, width, 3] for engines with a uint8 input, only the channel order of norm
+// is applied.
+void warp_affine_nhwc(const Image &image, uint8_t *dst, int dst_width, int dst_height,
+                      const float *matrix_2_3, uint8_t const_value, ChannelType channel_type,
+                      Interp interp);
+
+// Conversions to and from the other input/output dtypes, F16C/AVX2 when the cpu has them. The
+// results equal the cuda ones: half is IEEE binary16 (round to nearest even), int8 is
+// saturate(round_half_even(x * (1 / scale))), the same as the int8 input binding gets on device.
+void float_to_half(const float *src, uint16_t *dst, size_t n);
+void half_to_float(const uint16_t *src, float *dst, size_t n);
+void quantize_int8(const float *src, int8_t *dst, size_t n, float scale);
+
+// 64 bit hash of the pixels (row by row, the stride does not matter), the size, the format and
+// the option values of image (equal options give equal hashes, whichever object holds them).
+// AVX2 when the cpu has it, the value is the same either way. The key of
+// cpm::Instance::set_dedup for identical frames; 0 for an empty image.
+uint64_t content_hash(const Image &image);
+
+// number of the n bytes of a and b whose absolute difference is above threshold, AVX2 when the
+// cpu has it
+size_t count_differences(const uint8_t *a, const uint8_t *b, size_t n, uint8_t threshold);
+
+// Host version of decode + nms for the raw bbox head of one image, [num_bboxes, output_cdim] as
+// the engine writes it. d2i maps the network input back to the image. The rules are those of the
+// cuda decode, including the top max_boxes selection before nms. Segmentation masks are not
+// decoded.
+BoxArray decode_boxes(const float *predict, int num_bboxes, int num_classes, int output_cdim,
+                      Type type, const float *d2i, float confidence_threshold,
+                      float nms_threshold, int max_boxes = 1024,
+                      const DecodeOptions &options = DecodeOptions());
+
+// fp16 head (half bits), widened with F16C a block of rows at a time
+BoxArray decode_boxes(const uint16_t *predict, int num_bboxes, int num_classes, int output_cdim,
+                      Type type, const float *d2i, float confidence_threshold,
+                      float nms_threshold, int max_boxes = 1024,
+                      const DecodeOptions &options = DecodeOptions());
+
+// nms with the rule of the decode, for boxes merged from several forwards (tiles, mosaics)
+BoxArray nms(const BoxArray &boxes, float threshold, bool class_agnostic = false);
+
+// scratch of limit_detections, kept by the caller so that repeated calls do not allocate
+struct LimitBuffers {
+  std::vector<int> order;
+  std::vector<char> keep;
+  std::vector<int> per_class;
+
+  void reserve(int max_boxes, int num_classes) {
+    order.reserve(max_boxes);
+    keep.reserve(max_boxes);
+    per_class.reserve(num_classes);
+  }
+};
+
+// max_detections / max_per_class of DecodeOptions: the most confident boxes stay (ties to the
+// lower index) in their original order. kept, if given, receives the indices of the survivors.
+// Without buffers the scratch is allocated per call.
+void limit_detections(BoxArray &boxes, int max_detections, int max_per_class,
+                      std::vector<int> *kept = nullptr, LimitBuffers *buffers = nullptr);
+
+};  // namespace cpu
 
 const char *type_name(Type type);
 std::tuple<uint8_t, uint8_t, uint8_t> hsv2bgr(float h, float s, float v);
@@ -0,0 +1,917 @@
+#include <string.h>
+
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#include "yolo.hpp"
+#include "yolo_kernel.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define YOLO_X86_SIMD
+#endif
+
+// keep a * b + c as two roundings, the simd paths must match the scalar code bit for bit
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#elif defined(__GNUC__)
+#pragma GCC optimize("fp-contract=off")
+#endif
+
+namespace yolo {
+
+using namespace std;
+
+bool DecodeOptions::thresholds(int num_classes, float confidence_threshold, float *table) const {
+  if (class_thresholds.empty() && classes.empty()) return false;
+
+  auto threshold = [&](int label) {
+    return label < (int)class_thresholds.size() ? class_thresholds[label] : confidence_threshold;
+  };
+
+  if (classes.empty()) {
+    for (int i = 0; i < num_classes; ++i) table[i] = threshold(i);
+    return true;
+  }
+
+  std::fill(table, table + num_classes, INFINITY);
+  for (int label : classes) {
+    if (label >= 0 && label < num_classes) table[label] = threshold(label);
+  }
+  return true;
+}
+
+tuple<int, int> rect_input_size(int width, int height, int target_width, int target_height,
+                                int align) {
+  float scale = std::min(target_width / (float)width, target_height / (float)height);
+  int scaled_width = (int)ceilf(width * scale - 1e-3f);
+  int scaled_height = (int)ceilf(height * scale - 1e-3f);
+  return make_tuple((scaled_width + align - 1) / align * align,
+                    (scaled_height + align - 1) / align * align);
+}
+
+Image Image::nv12(const void *y, const void *uv, int width, int height, int stride) {
+  Image image(y, width, height, stride);
+  image.format = PixelFormat::NV12;
+  image.uptr = uv;
+  return image;
+}
+
+Image Image::i420(const void *y, const void *u, const void *v, int width, int height,
+                  int stride) {
+  Image image(y, width, height, stride);
+  image.format = PixelFormat::I420;
+  image.uptr = u;
+  image.vptr = v;
+  return image;
+}
+
+Image Image::yuyv(const void *data, int width, int height, int stride) {
+  Image image(data, width, height, stride);
+  image.format = PixelFormat::YUYV;
+  return image;
+}
+
+int Image::line_size() const {
+  if (stride > 0) return stride;
+
+  switch (format) {
+    case PixelFormat::NV12:
+    case PixelFormat::I420:
+      return width;
+    case PixelFormat::YUYV:
+      return width * 2;
+    default:
+      return width * 3;
+  }
+}
+
+Image Image::crop(int x, int y, int w, int h) const {
+  PlaneView view = plane_view(*this);
+  Image out = *this;
+  out.width = w;
+  out.height = h;
+  out.stride = view.line_size[0];
+
+  switch (format) {
+    case PixelFormat::NV12:
+    case PixelFormat::I420:
+      x &= ~1;
+      y &= ~1;
+      out.bgrptr = view.data[0] + (size_t)y * view.line_size[0] + x;
+      out.uptr = view.data[1] + (size_t)(y / 2) * view.line_size[1] +
+                 (format == PixelFormat::NV12 ? x : x / 2);
+      if (format == PixelFormat::I420)
+        out.vptr = view.data[2] + (size_t)(y / 2) * view.line_size[2] + x / 2;
+      break;
+    case PixelFormat::YUYV:
+      x &= ~1;
+      out.bgrptr = view.data[0] + (size_t)y * view.line_size[0] + x * 2;
+      break;
+    default:
+      out.bgrptr = view.data[0] + (size_t)y * view.line_size[0] + x * 3;
+      break;
+  }
+  return out;
+}
+
+namespace cpu {
+
+// Bilinear sampling of a pure scaling letterbox (AffineMatrix::compute, no rotation). The sample
+// position of a column does not depend on the row and vice versa, so it is computed once per
+// axis, and the inner rows are done 8 (avx2) or 16 (avx512) pixels at a time. Weights stay in
+// float with the same operation order as warp_affine_pixel, the output is identical to it.
+struct ScaleAxis {
+  std::vector<int> offset;  // x_low * 3 for columns
+  std::vector<float> l, h;  // lx, hx
+  int begin = 0, end = 0;   // [begin, end) have all neighbours inside the image
+  int safe_end = 0;         // x_high < size - 1, a 4 byte gather does not read past the image
+};
+
+static void scale_axis(float scale, float offset, int dst_size, int src_size, int bytes,
+                       ScaleAxis &axis) {
+  axis.offset.resize(dst_size);
+  axis.l.resize(dst_size);
+  axis.h.resize(dst_size);
+  axis.begin = dst_size;
+  axis.end = 0;
+  axis.safe_end = 0;
+  for (int d = 0; d < dst_size; ++d) {
+    float s = add_rn(mul_rn(scale, d), offset);
+    int low = floorf(s);
+    axis.offset[d] = low * bytes;
+    axis.l[d] = s - low;
+    axis.h[d] = 1 - axis.l[d];
+    if (s > -1 && s < src_size && low >= 0 && low + 1 < src_size) {
+      axis.begin = std::min(axis.begin, d);
+      axis.end = d + 1;
+      if (low + 1 < src_size - 1) axis.safe_end = d + 1;
+    }
+  }
+}
+
+struct ScaleRow {
+  const uint8_t *row0, *row1;
+  float ly, hy;
+  bool swap_rb, normalize;
+};
+
+#ifdef YOLO_X86_SIMD
+__attribute__((target("avx2"))) static inline __m256 channel_avx2(__m256i pixel, int shift) {
+  return _mm256_cvtepi32_ps(
+      _mm256_and_si256(_mm256_srli_epi32(pixel, shift), _mm256_set1_epi32(0xFF)));
+}
+
+__attribute__((target("avx2"))) static int scale_row_avx2(const ScaleRow &row,
+                                                         const ScaleAxis &cols, int begin,
+                                                         int end, const NormParams &norm,
+                                                         float *pdst[3]) {
+  __m256 hy = _mm256_set1_ps(row.hy);
+  __m256 ly = _mm256_set1_ps(row.ly);
+  __m256i three = _mm256_set1_epi32(3);
+  int dx = begin;
+  for (; dx + 8 <= end; dx += 8) {
+    __m256i xl = _mm256_loadu_si256((const __m256i *)(cols.offset.data() + dx));
+    __m256i xh = _mm256_add_epi32(xl, three);
+    __m256i p1 = _mm256_i32gather_epi32((const int *)row.row0, xl, 1);
+    __m256i p2 = _mm256_i32gather_epi32((const int *)row.row0, xh, 1);
+    __m256i p3 = _mm256_i32gather_epi32((const int *)row.row1, xl, 1);
+    __m256i p4 = _mm256_i32gather_epi32((const int *)row.row1, xh, 1);
+    __m256 lx = _mm256_loadu_ps(cols.l.data() + dx);
+    __m256 hx = _mm256_loadu_ps(cols.h.data() + dx);
+    __m256 w1 = _mm256_mul_ps(hy, hx), w2 = _mm256_mul_ps(hy, lx);
+    __m256 w3 = _mm256_mul_ps(ly, hx), w4 = _mm256_mul_ps(ly, lx);
+
+    __m256 c[3];
+    for (int ic = 0; ic < 3; ++ic) {
+      int shift = ic * 8;
+      __m256 sum = _mm256_add_ps(_mm256_mul_ps(w1, channel_avx2(p1, shift)),
+                                 _mm256_mul_ps(w2, channel_avx2(p2, shift)));
+      sum = _mm256_add_ps(sum, _mm256_mul_ps(w3, channel_avx2(p3, shift)));
+      sum = _mm256_add_ps(sum, _mm256_mul_ps(w4, channel_avx2(p4, shift)));
+      c[ic] = _mm256_floor_ps(_mm256_add_ps(sum, _mm256_set1_ps(0.5f)));
+    }
+
+    if (row.swap_rb) std::swap(c[0], c[2]);
+    for (int ic = 0; ic < 3; ++ic) {
+      if (row.normalize)
+        c[ic] = _mm256_add_ps(_mm256_mul_ps(c[ic], _mm256_set1_ps(norm.scale[ic])),
+                              _mm256_set1_ps(norm.offset[ic]));
+      _mm256_storeu_ps(pdst[ic] + dx, c[ic]);
+    }
+  }
+  return dx;
+}
+
+__attribute__((target("avx512f"))) static inline __m512 channel_avx512(__m512i pixel, int shift) {
+  return _mm512_cvtepi32_ps(
+      _mm512_and_si512(_mm512_srli_epi32(pixel, shift), _mm512_set1_epi32(0xFF)));
+}
+
+__attribute__((target("avx512f"))) static int scale_row_avx512(const ScaleRow &row,
+                                                              const ScaleAxis &cols, int begin,
+                                                              int end, const NormParams &norm,
+                                                              float *pdst[3]) {
+  __m512 hy = _mm512_set1_ps(row.hy);
+  __m512 ly = _mm512_set1_ps(row.ly);
+  __m512i three = _mm512_set1_epi32(3);
+  int dx = begin;
+  for (; dx + 16 <= end; dx += 16) {
+    __m512i xl = _mm512_loadu_si512((const void *)(cols.offset.data() + dx));
+    __m512i xh = _mm512_add_epi32(xl, three);
+    __m512i p1 = _mm512_i32gather_epi32(xl, (const void *)row.row0, 1);
+    __m512i p2 = _mm512_i32gather_epi32(xh, (const void *)row.row0, 1);
+    __m512i p3 = _mm512_i32gather_epi32(xl, (const void *)row.row1, 1);
+    __m512i p4 = _mm512_i32gather_epi32(xh, (const void *)row.row1, 1);
+    __m512 lx = _mm512_loadu_ps(cols.l.data() + dx);
+    __m512 hx = _mm512_loadu_ps(cols.h.data() + dx);
+    __m512 w1 = _mm512_mul_ps(hy, hx), w2 = _mm512_mul_ps(hy, lx);
+    __m512 w3 = _mm512_mul_ps(ly, hx), w4 = _mm512_mul_ps(ly, lx);
+
+    __m512 c[3];
+    for (int ic = 0; ic < 3; ++ic) {
+      int shift = ic * 8;
+      __m512 sum = _mm512_add_ps(_mm512_mul_ps(w1, channel_avx512(p1, shift)),
+                                 _mm512_mul_ps(w2, channel_avx512(p2, shift)));
+      sum = _mm512_add_ps(sum, _mm512_mul_ps(w3, channel_avx512(p3, shift)));
+      sum = _mm512_add_ps(sum, _mm512_mul_ps(w4, channel_avx512(p4, shift)));
+      c[ic] = _mm512_roundscale_ps(_mm512_add_ps(sum, _mm512_set1_ps(0.5f)),
+                                   _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    }
+
+    if (row.swap_rb) std::swap(c[0], c[2]);
+    for (int ic = 0; ic < 3; ++ic) {
+      if (row.normalize)
+        c[ic] = _mm512_add_ps(_mm512_mul_ps(c[ic], _mm512_set1_ps(norm.scale[ic])),
+                              _mm512_set1_ps(norm.offset[ic]));
+      _mm512_storeu_ps(pdst[ic] + dx, c[ic]);
+    }
+  }
+  return dx;
+}
+#endif
+
+enum class SimdLevel : int { None = 0, AVX2 = 1, AVX512 = 2 };
+
+static SimdLevel simd_level() {
+#ifdef YOLO_X86_SIMD
+  static SimdLevel level = __builtin_cpu_supports("avx512f")
+                               ? SimdLevel::AVX512
+                               : (__builtin_cpu_supports("avx2") ? SimdLevel::AVX2
+                                                                 : SimdLevel::None);
+  return level;
+#else
+  return SimdLevel::None;
+#endif
+}
+
+static bool is_pure_scale(const PlaneView &src, const Matrix2x3 &matrix) {
+  return src.format == PixelFormat::BGR && matrix.m[1] == 0 && matrix.m[3] == 0 &&
+         matrix.m[0] > 0 && matrix.m[4] > 0;
+}
+
+template <NormType norm_type, ChannelType channel_type>
+static void warp_affine_scale_bgr(const PlaneView &src, float *dst, int dst_width, int dst_height,
+                                  uint8_t const_value, const Matrix2x3 &matrix,
+                                  const NormParams &norm) {
+  int area = dst_width * dst_height;
+  ScaleAxis cols, rows;
+  scale_axis(matrix.m[0], matrix.m[2], dst_width, src.width, 3, cols);
+  scale_axis(matrix.m[4], matrix.m[5], dst_height, src.height, 1, rows);
+  SimdLevel level = simd_level();
+
+#pragma omp parallel for
+  for (int dy = 0; dy < dst_height; ++dy) {
+    int dx = 0;
+    if (dy >= rows.begin && dy < rows.end) {
+      for (; dx < cols.begin; ++dx)
+        warp_affine_pixel<norm_type, channel_type, Interp::Bilinear>(
+            src, matrix, norm, const_value, dx, dy, dst_width, area, dst);
+
+      ScaleRow row;
+      row.row0 = src.data[0] + rows.offset[dy] * src.line_size[0];
+      row.row1 = row.row0 + src.line_size[0];
+      row.ly = rows.l[dy];
+      row.hy = rows.h[dy];
+      row.swap_rb = channel_type == ChannelType::SwapRB;
+      row.normalize = norm_type != NormType::None;
+
+      // the last image row has nothing behind its last pixel to gather from
+      bool last_row = rows.offset[dy] + 1 == src.height - 1;
+      int end = last_row ? cols.safe_end : cols.end;
+      float *pdst[] = {dst + dy * dst_width, dst + dy * dst_width + area,
+                       dst + dy * dst_width + area * 2};
+#ifdef YOLO_X86_SIMD
+      if (level == SimdLevel::AVX512)
+        dx = scale_row_avx512(row, cols, dx, end, norm, pdst);
+      else if (level == SimdLevel::AVX2)
+        dx = scale_row_avx2(row, cols, dx, end, norm, pdst);
+#endif
+    }
+
+    for (; dx < dst_width; ++dx)
+      warp_affine_pixel<norm_type, channel_type, Interp::Bilinear>(
+          src, matrix, norm, const_value, dx, dy, dst_width, area, dst);
+  }
+}
+
+template <NormType norm_type, ChannelType channel_type, Interp interp>
+static bool warp_affine_fast_path(const PlaneView &src, float *dst, int dst_width,
+                                  int dst_height, uint8_t const_value, const Matrix2x3 &matrix,
+                                  const NormParams &norm) {
+  if (interp != Interp::Bilinear || simd_level() == SimdLevel::None ||
+      !is_pure_scale(src, matrix))
+    return false;
+
+  warp_affine_scale_bgr<norm_type, channel_type>(src, dst, dst_width, dst_height, const_value,
+                                                 matrix, norm);
+  return true;
+}
+
+template <NormType norm_type, ChannelType channel_type, Interp interp, typename TOut>
+static bool warp_affine_fast_path(const PlaneView &src, TOut *dst, int dst_width, int dst_height,
+                                  uint8_t const_value, const Matrix2x3 &matrix,
+                                  const NormParams &norm) {
+  return false;
+}
+
+template <NormType norm_type, ChannelType channel_type, Interp interp, typename TOut>
+struct WarpAffineRows {
+  static void run(const PlaneView &src, TOut *dst, int dst_width, int dst_height,
+                  uint8_t const_value, const Matrix2x3 &matrix, const NormParams &norm) {
+    if (warp_affine_fast_path<norm_type, channel_type, interp>(src, dst, dst_width, dst_height,
+                                                               const_value, matrix, norm))
+      return;
+
+    int area = dst_width * dst_height;
+
+#pragma omp parallel for
+    for (int dy = 0; dy < dst_height; ++dy) {
+#pragma omp simd
+      for (int dx = 0; dx < dst_width; ++dx) {
+        warp_affine_pixel<norm_type, channel_type, interp>(src, matrix, norm, const_value, dx,
+                                                           dy, dst_width, area, dst);
+      }
+    }
+  }
+};
+
+void warp_affine_and_normalize_plane(const Image &image, float *dst, int dst_width,
+                                     int dst_height, const float *matrix_2_3, uint8_t const_value,
+                                     const Norm &norm, Interp interp) {
+  dispatch_preprocess<WarpAffineRows, float>(norm, interp, plane_view(image), dst, dst_width,
+                                             dst_height, const_value, make_matrix(matrix_2_3),
+                                             fold_norm(norm));
+}
+
+void warp_affine_bilinear_and_normalize_plane(const Image &image, float *dst, int dst_width,
+                                              int dst_height, const float *matrix_2_3,
+                                              uint8_t const_value, const Norm &norm) {
+  warp_affine_and_normalize_plane(image, dst, dst_width, dst_height, matrix_2_3, const_value,
+                                  norm, Interp::Bilinear);
+}
+
+void warp_affine_nhwc(const Image &image, uint8_t *dst, int dst_width, int dst_height,
+                      const float *matrix_2_3, uint8_t const_value, ChannelType channel_type,
+                      Interp interp) {
+  Norm norm = Norm::None();
+  norm.channel_type = channel_type;
+  dispatch_preprocess<WarpAffineRows, uint8_t>(norm, interp, plane_view(image), dst, dst_width,
+                                               dst_height, const_value, make_matrix(matrix_2_3),
+                                               fold_norm(norm));
+}
+
+static uint16_t float_to_half_value(float value) {
+  uint32_t x;
+  memcpy(&x, &value, sizeof(x));
+  uint32_t sign = (x >> 16) & 0x8000;
+  uint32_t mantissa = x & 0x7FFFFF;
+  int exponent = (x >> 23) & 0xFF;
+  if (exponent == 0xFF) return sign | 0x7C00 | (mantissa ? 0x200 | (mantissa >> 13) : 0);
+
+  exponent = exponent - 127 + 15;
+  if (exponent >= 31) return sign | 0x7C00;
+
+  // subnormal half, the implicit bit is shifted into the mantissa
+  int shift = 13;
+  uint32_t half = exponent << 10;
+  if (exponent <= 0) {
+    if (exponent < -10) return sign;
+    mantissa |= 0x800000;
+    shift = 14 - exponent;
+    half = 0;
+  }
+
+  // round to nearest even, a carry into the exponent is what we want
+  uint32_t rest = mantissa & ((1u << shift) - 1);
+  uint32_t midpoint = 1u << (shift - 1);
+  half += mantissa >> shift;
+  if (rest > midpoint || (rest == midpoint && (half & 1))) ++half;
+  return sign | half;
+}
+
+static float half_to_float_value(uint16_t value) {
+  uint32_t sign = (uint32_t)(value & 0x8000) << 16;
+  int exponent = (value >> 10) & 0x1F;
+  uint32_t mantissa = value & 0x3FF;
+  uint32_t x = sign;
+  if (exponent == 0x1F) {
+    x |= 0x7F800000 | (mantissa << 13);
+  } else if (exponent != 0) {
+    x |= ((exponent + 112) << 23) | (mantissa << 13);
+  } else if (mantissa != 0) {
+    exponent = 1;
+    while (!(mantissa & 0x400)) {
+      mantissa <<= 1;
+      --exponent;
+    }
+    x |= ((exponent + 112) << 23) | ((mantissa & 0x3FF) << 13);
+  }
+
+  float out;
+  memcpy(&out, &x, sizeof(out));
+  return out;
+}
+
+#ifdef YOLO_X86_SIMD
+__attribute__((target("avx,f16c"))) static size_t float_to_half_f16c(const float *src,
+                                                                     uint16_t *dst, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i half = _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+    _mm_storeu_si128((__m128i *)(dst + i), half);
+  }
+  return i;
+}
+
+__attribute__((target("avx,f16c"))) static size_t half_to_float_f16c(const uint16_t *src,
+                                                                     float *dst, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(src + i))));
+  return i;
+}
+
+// same clamp order as saturate_round, nan ends at -128
+__attribute__((target("avx2"))) static size_t quantize_int8_avx2(const float *src, int8_t *dst,
+                                                                size_t n, float out_scale) {
+  __m256 scale = _mm256_set1_ps(out_scale);
+  __m256 low = _mm256_set1_ps(-128.0f), high = _mm256_set1_ps(127.0f);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 value = _mm256_mul_ps(_mm256_loadu_ps(src + i), scale);
+    value = _mm256_min_ps(_mm256_max_ps(value, low), high);
+    __m256i q = _mm256_cvtps_epi32(value);
+    q = _mm256_packs_epi16(_mm256_packs_epi32(q, q), q);
+    __m128i packed =
+        _mm_unpacklo_epi32(_mm256_castsi256_si128(q), _mm256_extracti128_si256(q, 1));
+    _mm_storel_epi64((__m128i *)(dst + i), packed);
+  }
+  return i;
+}
+#endif
+
+void float_to_half(const float *src, uint16_t *dst, size_t n) {
+  size_t i = 0;
+#ifdef YOLO_X86_SIMD
+  if (__builtin_cpu_supports("f16c")) i = float_to_half_f16c(src, dst, n);
+#endif
+  for (; i < n; ++i) dst[i] = float_to_half_value(src[i]);
+}
+
+void half_to_float(const uint16_t *src, float *dst, size_t n) {
+  size_t i = 0;
+#ifdef YOLO_X86_SIMD
+  if (__builtin_cpu_supports("f16c")) i = half_to_float_f16c(src, dst, n);
+#endif
+  for (; i < n; ++i) dst[i] = half_to_float_value(src[i]);
+}
+
+void quantize_int8(const float *src, int8_t *dst, size_t n, float scale) {
+  float out_scale = 1.0f / scale;
+  size_t i = 0;
+#ifdef YOLO_X86_SIMD
+  if (simd_level() != SimdLevel::None) i = quantize_int8_avx2(src, dst, n, out_scale);
+#endif
+  for (; i < n; ++i) dst[i] = saturate_round(mul_rn(src[i], out_scale), -128, 127);
+}
+
+#ifdef YOLO_X86_SIMD
+// |a - b| > threshold as max(a - b, b - a) saturated, minus threshold, not zero
+__attribute__((target("avx2"))) static size_t count_differences_avx2(const uint8_t *a,
+                                                                     const uint8_t *b, size_t n,
+                                                                     uint8_t threshold,
+                                                                     size_t &count) {
+  const __m256i limit = _mm256_set1_epi8((char)threshold);
+  const __m256i zero = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+    __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+    __m256i diff = _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+    __m256i over = _mm256_cmpeq_epi8(_mm256_subs_epu8(diff, limit), zero);
+    count += 32 - __builtin_popcount((uint32_t)_mm256_movemask_epi8(over));
+  }
+  return i;
+}
+#endif
+
+size_t count_differences(const uint8_t *a, const uint8_t *b, size_t n, uint8_t threshold) {
+  size_t count = 0, i = 0;
+#ifdef YOLO_X86_SIMD
+  if (simd_level() != SimdLevel::None) i = count_differences_avx2(a, b, n, threshold, count);
+#endif
+  for (; i < n; ++i) count += (a[i] > b[i] ? a[i] - b[i] : b[i] - a[i]) > threshold;
+  return count;
+}
+
+// content_hash: four 64 bit lanes over stripes of 32 bytes, the accumulate and scramble rounds
+// of xxh3. Rows end with a zero padded stripe, so the stride of the image does not matter.
+static const uint64_t HASH_KEY[4] = {0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL,
+                                     0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL};
+static const uint64_t HASH_PRIME = 0x9e3779b1ULL;
+static const int HASH_BLOCK_STRIPES = 32;  // scramble every 1 KB
+
+static inline uint64_t mix64(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+static inline void hash_stripe(uint64_t acc[4], const uint8_t *p) {
+  uint64_t data[4];
+  memcpy(data, p, sizeof(data));
+  for (int i = 0; i < 4; ++i) {
+    uint64_t key = data[i] ^ HASH_KEY[i];
+    acc[i ^ 1] += data[i];
+    acc[i] += (key & 0xffffffffULL) * (key >> 32);
+  }
+}
+
+static inline void hash_scramble(uint64_t acc[4]) {
+  for (int i = 0; i < 4; ++i) {
+    acc[i] ^= acc[i] >> 47;
+    acc[i] ^= HASH_KEY[i];
+    acc[i] *= HASH_PRIME;
+  }
+}
+
+static void hash_row(uint64_t acc[4], const uint8_t *p, int bytes, int &stripes) {
+  for (; bytes > 0; bytes -= 32, p += 32) {
+    if (bytes >= 32) {
+      hash_stripe(acc, p);
+    } else {
+      uint8_t tail[32] = {0};
+      memcpy(tail, p, bytes);
+      hash_stripe(acc, tail);
+    }
+    if (++stripes % HASH_BLOCK_STRIPES == 0) hash_scramble(acc);
+  }
+}
+
+#ifdef YOLO_X86_SIMD
+__attribute__((target("avx2"))) static inline __m256i hash_stripe_avx2(__m256i acc, __m256i data,
+                                                                       __m256i key) {
+  __m256i data_key = _mm256_xor_si256(data, key);
+  __m256i product = _mm256_mul_epu32(data_key, _mm256_srli_epi64(data_key, 32));
+  __m256i swapped = _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));  // lane i ^ 1
+  return _mm256_add_epi64(_mm256_add_epi64(acc, swapped), product);
+}
+
+__attribute__((target("avx2"))) static void hash_row_avx2(uint64_t acc[4], const uint8_t *p,
+                                                          int bytes, int &stripes) {
+  const __m256i key = _mm256_loadu_si256((const __m256i *)HASH_KEY);
+  const __m256i prime = _mm256_set1_epi64x(HASH_PRIME);
+  __m256i vacc = _mm256_loadu_si256((const __m256i *)acc);
+  for (; bytes > 0; bytes -= 32, p += 32) {
+    __m256i data;
+    if (bytes >= 32) {
+      data = _mm256_loadu_si256((const __m256i *)p);
+    } else {
+      uint8_t tail[32] = {0};
+      memcpy(tail, p, bytes);
+      data = _mm256_loadu_si256((const __m256i *)tail);
+    }
+    vacc = hash_stripe_avx2(vacc, data, key);
+
+    if (++stripes % HASH_BLOCK_STRIPES == 0) {
+      // the low 64 bits of acc * prime, prime has 32 bits
+      __m256i mixed = _mm256_xor_si256(vacc, _mm256_srli_epi64(vacc, 47));
+      mixed = _mm256_xor_si256(mixed, key);
+      __m256i low = _mm256_mul_epu32(mixed, prime);
+      __m256i high = _mm256_mul_epu32(_mm256_srli_epi64(mixed, 32), prime);
+      vacc = _mm256_add_epi64(low, _mm256_slli_epi64(high, 32));
+    }
+  }
+  _mm256_storeu_si256((__m256i *)acc, vacc);
+}
+#endif
+
+static uint64_t float_bits(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+}
+
+// the values of the options, not their address: a freed ImageOptions may be reallocated with
+// other values at the same place. No options and default options are told apart.
+static uint64_t hash_options(uint64_t h, const ImageOptions *options) {
+  if (options == nullptr) return mix64(h ^ 0x9e3779b97f4a7c15ull);
+
+  const DecodeOptions &decode = options->decode;
+  h = mix64(h ^ (float_bits(options->confidence_threshold) << 32 |
+                 float_bits(options->nms_threshold)));
+  h = mix64(h ^ ((uint64_t)(uint32_t)decode.max_detections << 32 |
+                 (uint32_t)decode.max_per_class));
+  h = mix64(h ^ (uint64_t)decode.class_agnostic);
+  h = mix64(h ^ decode.class_thresholds.size());
+  for (float threshold : decode.class_thresholds) h = mix64(h ^ float_bits(threshold));
+  h = mix64(h ^ decode.classes.size());
+  for (int label : decode.classes) h = mix64(h ^ (uint32_t)label);
+  return h;
+}
+
+uint64_t content_hash(const Image &image) {
+  if (image.bgrptr == nullptr || image.width <= 0 || image.height <= 0) return 0;
+
+  PlaneView view = plane_view(image);
+  uint64_t acc[4] = {HASH_KEY[0] ^ HASH_PRIME, HASH_KEY[1], HASH_KEY[2], HASH_KEY[3]};
+  int stripes = 0;
+  void (*row_hash)(uint64_t *, const uint8_t *, int, int &) = hash_row;
+#ifdef YOLO_X86_SIMD
+  if (simd_level() != SimdLevel::None) row_hash = hash_row_avx2;
+#endif
+  for (int plane = 0; plane < view.num_planes; ++plane) {
+    for (int row = 0; row < view.rows[plane]; ++row)
+      row_hash(acc, view.data[plane] + (size_t)row * view.line_size[plane],
+               view.row_bytes[plane], stripes);
+  }
+
+  // the shape, the format and the options take part, such images never share a result
+  uint64_t h = ((uint64_t)image.width << 32 | (uint32_t)image.height) ^
+               ((uint64_t)image.format << 60);
+  h = hash_options(h, image.options.get());
+  for (int i = 0; i < 4; ++i) h = mix64(h ^ acc[i]);
+  return h;
+}
+
+static void affine_project(const float *matrix, float x, float y, float *ox, float *oy) {
+  *ox = matrix[0] * x + matrix[1] * y + matrix[2];
+  *oy = matrix[3] * x + matrix[4] * y + matrix[5];
+}
+
+#ifdef YOLO_X86_SIMD
+// Scores of 8 or more classes: the maximum first, its (first) index only when it reaches
+// threshold. Same result as argmax_classes.
+__attribute__((target("avx2"))) static bool argmax_classes_avx2(const float *scores, int n,
+                                                               float threshold, float &confidence,
+                                                               int &label) {
+  __m256 best = _mm256_loadu_ps(scores);
+  int i = 8;
+  for (; i + 8 <= n; i += 8) best = _mm256_max_ps(best, _mm256_loadu_ps(scores + i));
+
+  __m128 m = _mm_max_ps(_mm256_castps256_ps128(best), _mm256_extractf128_ps(best, 1));
+  m = _mm_max_ps(m, _mm_movehl_ps(m, m));
+  m = _mm_max_ss(m, _mm_shuffle_ps(m, m, 1));
+  confidence = _mm_cvtss_f32(m);
+  for (; i < n; ++i) confidence = scores[i] > confidence ? scores[i] : confidence;
+  if (confidence < threshold) return false;
+
+  __m256 target = _mm256_set1_ps(confidence);
+  for (i = 0; i + 8 <= n; i += 8) {
+    int mask =
+        _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(scores + i), target, _CMP_EQ_OQ));
+    if (mask) {
+      label = i + __builtin_ctz(mask);
+      return true;
+    }
+  }
+
+  while (i < n && scores[i] != confidence) ++i;
+  label = i < n ? i : 0;
+  return true;
+}
+#endif
+
+// count rows of the head, appends the boxes above the threshold (of their class when
+// class_thresholds is given, confidence_threshold is then the lowest of them). NUM_CLASSES as in
+// argmax_classes, more than 8 classes go through avx2 when the cpu has it.
+template <typename T, int NUM_CLASSES>
+struct DecodeRows {
+  static void run(const float *predict, int count, int num_classes, int output_cdim, Type type,
+                  const float *d2i, float confidence_threshold, const float *class_thresholds,
+                  BoxArray &boxes) {
+    const int n = NUM_CLASSES > 0 ? NUM_CLASSES : num_classes;
+    bool v8 = type == Type::V8 || type == Type::V8Seg;
+    bool avx2 = n >= 8 && simd_level() != SimdLevel::None;
+    for (int i = 0; i < count; ++i) {
+      const float *pitem = predict + (size_t)output_cdim * i;
+      float objectness = 1;
+      if (!v8) {
+        objectness = pitem[4];
+        if (objectness < confidence_threshold) continue;
+      }
+
+      const float *class_confidence = pitem + (v8 ? 4 : 5);
+      float confidence;
+      int label;
+#ifdef YOLO_X86_SIMD
+      if (avx2) {
+        // the class score alone is the confidence of v8, objectness scales it otherwise
+        float threshold = v8 ? confidence_threshold : -INFINITY;
+        if (!argmax_classes_avx2(class_confidence, n, threshold, confidence, label)) continue;
+      } else {
+        argmax_classes<NUM_CLASSES>(class_confidence, num_classes, confidence, label);
+      }
+#else
+      argmax_classes<NUM_CLASSES>(class_confidence, num_classes, confidence, label);
+#endif
+
+      if (!v8) confidence *= objectness;
+      if (confidence < (class_thresholds ? class_thresholds[label] : confidence_threshold))
+        continue;
+
+      float cx = pitem[0], cy = pitem[1], width = pitem[2], height = pitem[3];
+      float left = cx - width * 0.5f;
+      float top = cy - height * 0.5f;
+      float right = cx + width * 0.5f;
+      float bottom = cy + height * 0.5f;
+      affine_project(d2i, left, top, &left, &top);
+      affine_project(d2i, right, bottom, &right, &bottom);
+      boxes.emplace_back(left, top, right, bottom, confidence, label);
+    }
+  }
+};
+
+static void decode_rows(const float *predict, int count, int num_classes, int output_cdim,
+                        Type type, const float *d2i, float confidence_threshold,
+                        const float *class_thresholds, BoxArray &boxes) {
+  dispatch_num_classes<DecodeRows, float>(num_classes, predict, count, num_classes, output_cdim,
+                                          type, d2i, confidence_threshold, class_thresholds,
+                                          boxes);
+}
+
+static float box_iou(const Box &a, const Box &b) {
+  float cleft = std::max(a.left, b.left);
+  float ctop = std::max(a.top, b.top);
+  float cright = std::min(a.right, b.right);
+  float cbottom = std::min(a.bottom, b.bottom);
+
+  float c_area = std::max(cright - cleft, 0.0f) * std::max(cbottom - ctop, 0.0f);
+  if (c_area == 0.0f) return 0.0f;
+
+  float a_area = std::max(0.0f, a.right - a.left) * std::max(0.0f, a.bottom - a.top);
+  float b_area = std::max(0.0f, b.right - b.left) * std::max(0.0f, b.bottom - b.top);
+  return c_area / (a_area + b_area - c_area);
+}
+
+// select_topk_kernel on host: the max_boxes most confident boxes, ties at the cut are taken in
+// anchor order
+static BoxArray select_topk(BoxArray &boxes, int max_boxes) {
+  if ((int)boxes.size() <= max_boxes) return std::move(boxes);
+
+  std::vector<float> confidences(boxes.size());
+  for (size_t i = 0; i < boxes.size(); ++i) confidences[i] = boxes[i].confidence;
+  std::nth_element(confidences.begin(), confidences.begin() + (max_boxes - 1), confidences.end(),
+                   std::greater<float>());
+  float kth = confidences[max_boxes - 1];
+
+  int num_equal = max_boxes;
+  for (auto &box : boxes) num_equal -= box.confidence > kth;
+
+  BoxArray output;
+  output.reserve(max_boxes);
+  for (auto &box : boxes) {
+    if (box.confidence > kth || (box.confidence == kth && num_equal-- > 0)) output.push_back(box);
+  }
+  return output;
+}
+
+// fast_nms_kernel on host: a box goes when a box of its class (of any class if class_agnostic)
+// with a higher confidence (or the same confidence and a larger index) overlaps it by more than
+// the threshold
+static BoxArray fast_nms(const BoxArray &boxes, float threshold, bool class_agnostic) {
+  BoxArray output;
+  for (int position = 0; position < (int)boxes.size(); ++position) {
+    const Box &current = boxes[position];
+    bool keep = true;
+    for (int i = 0; i < (int)boxes.size() && keep; ++i) {
+      const Box &item = boxes[i];
+      if (i == position || (!class_agnostic && item.class_label != current.class_label)) continue;
+      if (item.confidence < current.confidence) continue;
+      if (item.confidence == current.confidence && i < position) continue;
+      keep = box_iou(current, item) <= threshold;
+    }
+    if (keep) output.push_back(current);
+  }
+  return output;
+}
+
+BoxArray nms(const BoxArray &boxes, float threshold, bool class_agnostic) {
+  return fast_nms(boxes, threshold, class_agnostic);
+}
+
+void limit_detections(BoxArray &boxes, int max_detections, int max_per_class, vector<int> *kept,
+                      LimitBuffers *buffers) {
+  int count = boxes.size();
+  if (kept) {
+    kept->resize(count);
+    for (int i = 0; i < count; ++i) (*kept)[i] = i;
+  }
+  if ((max_detections <= 0 || count <= max_detections) && max_per_class <= 0) return;
+
+  LimitBuffers local;
+  if (buffers == nullptr) buffers = &local;
+
+  vector<int> &order = buffers->order;
+  order.resize(count);
+  for (int i = 0; i < count; ++i) order[i] = i;
+  std::sort(order.begin(), order.end(), [&](int a, int b) {
+    if (boxes[a].confidence != boxes[b].confidence)
+      return boxes[a].confidence > boxes[b].confidence;
+    return a < b;
+  });
+
+  vector<char> &keep = buffers->keep;
+  keep.assign(count, 0);
+  vector<int> &per_class = buffers->per_class;
+  per_class.clear();
+  int total = 0;
+  for (int i : order) {
+    if (max_detections > 0 && total >= max_detections) break;
+
+    if (max_per_class > 0) {
+      int label = boxes[i].class_label;
+      if (label >= (int)per_class.size()) per_class.resize(label + 1, 0);
+      if (per_class[label] >= max_per_class) continue;
+      per_class[label]++;
+    }
+    keep[i] = 1;
+    total++;
+  }
+
+  int written = 0;
+  for (int i = 0; i < count; ++i) {
+    if (!keep[i]) continue;
+    if (written != i) boxes[written] = std::move(boxes[i]);
+    if (kept) (*kept)[written] = i;
+    written++;
+  }
+  boxes.erase(boxes.begin() + written, boxes.end());
+  if (kept) kept->resize(written);
+}
+
+// top-k, nms and the caps of options on the decoded boxes
+static BoxArray finish_boxes(BoxArray &boxes, float nms_threshold, int max_boxes,
+                             const DecodeOptions &options) {
+  BoxArray output = fast_nms(select_topk(boxes, max_boxes), nms_threshold, options.class_agnostic);
+  limit_detections(output, options.max_detections, options.max_per_class);
+  return output;
+}
+
+// lowest threshold of the table, the early exits of the decode compare against it
+static float lowest_threshold(const float *table, int num_classes, float confidence_threshold) {
+  if (table == nullptr) return confidence_threshold;
+  return *std::min_element(table, table + num_classes);
+}
+
+BoxArray decode_boxes(const float *predict, int num_bboxes, int num_classes, int output_cdim,
+                      Type type, const float *d2i, float confidence_threshold,
+                      float nms_threshold, int max_boxes, const DecodeOptions &options) {
+  vector<float> thresholds(num_classes);
+  const float *table = options.thresholds(num_classes, confidence_threshold, thresholds.data())
+                           ? thresholds.data()
+                           : nullptr;
+  BoxArray boxes;
+  decode_rows(predict, num_bboxes, num_classes, output_cdim, type, d2i,
+              lowest_threshold(table, num_classes, confidence_threshold), table, boxes);
+  return finish_boxes(boxes, nms_threshold, max_boxes, options);
+}
+
+BoxArray decode_boxes(const uint16_t *predict, int num_bboxes, int num_classes, int output_cdim,
+                      Type type, const float *d2i, float confidence_threshold,
+                      float nms_threshold, int max_boxes, const DecodeOptions &options) {
+  vector<float> thresholds(num_classes);
+  const float *table = options.thresholds(num_classes, confidence_threshold, thresholds.data())
+                           ? thresholds.data()
+                           : nullptr;
+  float lowest = lowest_threshold(table, num_classes, confidence_threshold);
+
+  // a block of rows stays in cache between the conversion and the decode
+  const int block_rows = 64;
+  std::vector<float> rows((size_t)block_rows * output_cdim);
+  BoxArray boxes;
+  for (int first = 0; first < num_bboxes; first += block_rows) {
+    int count = std::min(block_rows, num_bboxes - first);
+    half_to_float(predict + (size_t)first * output_cdim, rows.data(), (size_t)count * output_cdim);
+    decode_rows(rows.data(), count, num_classes, output_cdim, type, d2i, lowest, table, boxes);
+  }
+  return finish_boxes(boxes, nms_threshold, max_boxes, options);
+}
+
+};  // namespace cpu
+
+};  // namespace yolo
@@ -0,0 +1,468 @@
+#ifndef __YOLO_KERNEL_HPP__
+#define __YOLO_KERNEL_HPP__
+
+// Per-pixel code shared by the cuda kernels (yolo.cu) and the cpu implementation (yolo_cpu.cpp)
+
+#include <math.h>
+#include <stdint.h>
+
+#include "yolo.hpp"
+
+#ifdef __CUDACC__
+#include <cuda_fp16.h>
+#define HOST_DEVICE __host__ __device__
+#else
+#define HOST_DEVICE
+#endif
+
+namespace yolo {
+
+// Where the planes of an image are. On host it points into the caller's Image, on device into
+// the packed upload (line_size == row_bytes).
+struct PlaneView {
+  const uint8_t *data[3];
+  int line_size[3];
+  int row_bytes[3];
+  int rows[3];
+  int num_planes;
+  int width, height;
+  PixelFormat format;
+};
+
+// planes of the caller's image, the chroma planes default to follow the previous plane
+inline PlaneView plane_view(const Image &image) {
+  PlaneView view;
+  int line_size = image.line_size();
+  view.width = image.width;
+  view.height = image.height;
+  view.format = image.format;
+  view.data[0] = (const uint8_t *)image.bgrptr;
+  view.line_size[0] = line_size;
+  view.rows[0] = image.height;
+  view.num_planes = 1;
+
+  switch (image.format) {
+    case PixelFormat::NV12:
+      view.row_bytes[0] = image.width;
+      view.data[1] = image.uptr ? (const uint8_t *)image.uptr
+                                : view.data[0] + (size_t)line_size * image.height;
+      view.line_size[1] = line_size;
+      view.row_bytes[1] = image.width;
+      view.rows[1] = image.height / 2;
+      view.num_planes = 2;
+      break;
+    case PixelFormat::I420:
+      view.row_bytes[0] = image.width;
+      view.data[1] = image.uptr ? (const uint8_t *)image.uptr
+                                : view.data[0] + (size_t)line_size * image.height;
+      view.data[2] = image.vptr ? (const uint8_t *)image.vptr
+                                : view.data[1] + (size_t)(line_size / 2) * (image.height / 2);
+      view.line_size[1] = view.line_size[2] = line_size / 2;
+      view.row_bytes[1] = view.row_bytes[2] = image.width / 2;
+      view.rows[1] = view.rows[2] = image.height / 2;
+      view.num_planes = 3;
+      break;
+    case PixelFormat::YUYV:
+      view.row_bytes[0] = image.width * 2;
+      break;
+    default:
+      view.row_bytes[0] = image.width * 3;
+      break;
+  }
+  return view;
+}
+
+inline size_t packed_bytes(const PlaneView &view) {
+  size_t bytes = 0;
+  for (int i = 0; i < view.num_planes; ++i) bytes += (size_t)view.row_bytes[i] * view.rows[i];
+  return bytes;
+}
+
+// the same planes laid out back to back without row padding, starting at base
+inline PlaneView packed_view(const PlaneView &view, const uint8_t *base) {
+  PlaneView out = view;
+  for (int i = 0; i < view.num_planes; ++i) {
+    out.data[i] = base;
+    out.line_size[i] = view.row_bytes[i];
+    base += (size_t)view.row_bytes[i] * view.rows[i];
+  }
+  return out;
+}
+
+// Multiply and add that are never fused into fma, so the cpu (scalar or simd) and the gpu round
+// the preprocess identically.
+HOST_DEVICE inline float mul_rn(float a, float b) {
+#ifdef __CUDA_ARCH__
+  return __fmul_rn(a, b);
+#else
+  return a * b;
+#endif
+}
+
+HOST_DEVICE inline float add_rn(float a, float b) {
+#ifdef __CUDA_ARCH__
+  return __fadd_rn(a, b);
+#else
+  return a + b;
+#endif
+}
+
+// BT.601 limited range, the same fixed point as cv::cvtColor(COLOR_YUV2BGR_*)
+HOST_DEVICE inline uint8_t saturate_shift20(int value) {
+  value = (value + (1 << 19)) >> 20;
+  return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+HOST_DEVICE inline void yuv2bgr(int y, int u, int v, uint8_t *bgr) {
+  int ry = (y > 16 ? y - 16 : 0) * 1220542;
+  u -= 128;
+  v -= 128;
+  bgr[0] = saturate_shift20(ry + 2116026 * u);
+  bgr[1] = saturate_shift20(ry - 409993 * u - 852492 * v);
+  bgr[2] = saturate_shift20(ry + 1673527 * v);
+}
+
+// bgr of pixel (x, y), chroma is shared by each 2x2 (4:2:0) or 2x1 (YUYV) block
+HOST_DEVICE inline void fetch_bgr(const PlaneView &src, int x, int y, uint8_t *bgr) {
+  if (src.format == PixelFormat::BGR) {
+    const uint8_t *p = src.data[0] + y * src.line_size[0] + x * 3;
+    bgr[0] = p[0];
+    bgr[1] = p[1];
+    bgr[2] = p[2];
+  } else if (src.format == PixelFormat::NV12) {
+    const uint8_t *uv = src.data[1] + (y >> 1) * src.line_size[1] + (x & ~1);
+    yuv2bgr(src.data[0][y * src.line_size[0] + x], uv[0], uv[1], bgr);
+  } else if (src.format == PixelFormat::I420) {
+    int chroma = (y >> 1) * src.line_size[1] + (x >> 1);
+    yuv2bgr(src.data[0][y * src.line_size[0] + x], src.data[1][chroma], src.data[2][chroma], bgr);
+  } else {
+    const uint8_t *p = src.data[0] + y * src.line_size[0] + (x & ~1) * 2;
+    yuv2bgr(p[(x & 1) * 2], p[1], p[3], bgr);
+  }
+}
+
+// w1 * v1 + w2 * v2 + w3 * v3 + w4 * v4 + 0.5, evaluated left to right
+HOST_DEVICE inline float bilinear_sum(float w1, float w2, float w3, float w4, float v1, float v2,
+                                      float v3, float v4) {
+  float sum = add_rn(mul_rn(w1, v1), mul_rn(w2, v2));
+  sum = add_rn(sum, mul_rn(w3, v3));
+  sum = add_rn(sum, mul_rn(w4, v4));
+  return add_rn(sum, 0.5f);
+}
+
+// bilinear sample at (src_x, src_y), neighbours outside the image take const_value
+HOST_DEVICE inline void bilinear_sample(const PlaneView &src, float src_x, float src_y,
+                                        uint8_t const_value, float &c0, float &c1, float &c2) {
+  if (src_x <= -1 || src_x >= src.width || src_y <= -1 || src_y >= src.height) {
+    // out of range
+    c0 = const_value;
+    c1 = const_value;
+    c2 = const_value;
+    return;
+  }
+
+  int y_low = floorf(src_y);
+  int x_low = floorf(src_x);
+  int y_high = y_low + 1;
+  int x_high = x_low + 1;
+
+  float ly = src_y - y_low;
+  float lx = src_x - x_low;
+  float hy = 1 - ly;
+  float hx = 1 - lx;
+  float w1 = mul_rn(hy, hx), w2 = mul_rn(hy, lx), w3 = mul_rn(ly, hx), w4 = mul_rn(ly, lx);
+  uint8_t v1[] = {const_value, const_value, const_value};
+  uint8_t v2[] = {const_value, const_value, const_value};
+  uint8_t v3[] = {const_value, const_value, const_value};
+  uint8_t v4[] = {const_value, const_value, const_value};
+  if (y_low >= 0) {
+    if (x_low >= 0) fetch_bgr(src, x_low, y_low, v1);
+
+    if (x_high < src.width) fetch_bgr(src, x_high, y_low, v2);
+  }
+
+  if (y_high < src.height) {
+    if (x_low >= 0) fetch_bgr(src, x_low, y_high, v3);
+
+    if (x_high < src.width) fetch_bgr(src, x_high, y_high, v4);
+  }
+
+  // same to opencv
+  c0 = floorf(bilinear_sum(w1, w2, w3, w4, v1[0], v2[0], v3[0], v4[0]));
+  c1 = floorf(bilinear_sum(w1, w2, w3, w4, v1[1], v2[1], v3[1], v4[1]));
+  c2 = floorf(bilinear_sum(w1, w2, w3, w4, v1[2], v2[2], v3[2], v4[2]));
+}
+
+// nearest source pixel of (src_x, src_y), outside the image takes const_value
+HOST_DEVICE inline void nearest_sample(const PlaneView &src, float src_x, float src_y,
+                                       uint8_t const_value, float &c0, float &c1, float &c2) {
+  int x = floorf(add_rn(src_x, 0.5f));
+  int y = floorf(add_rn(src_y, 0.5f));
+  if (x < 0 || x >= src.width || y < 0 || y >= src.height) {
+    c0 = const_value;
+    c1 = const_value;
+    c2 = const_value;
+    return;
+  }
+
+  uint8_t v[3];
+  fetch_bgr(src, x, y, v);
+  c0 = v[0];
+  c1 = v[1];
+  c2 = v[2];
+}
+
+// Mean over the footprint (fx, fy) of the dst pixel centred at (src_x, src_y), border pixels are
+// weighted by their coverage and pixels outside the image take const_value. Like cv::INTER_AREA
+// it only makes sense when shrinking, enlarging falls back to bilinear.
+HOST_DEVICE inline void area_sample(const PlaneView &src, float src_x, float src_y, float fx,
+                                    float fy, uint8_t const_value, float &c0, float &c1,
+                                    float &c2) {
+  if (fx <= 1 && fy <= 1) {
+    bilinear_sample(src, src_x, src_y, const_value, c0, c1, c2);
+    return;
+  }
+
+  fx = fx < 1 ? 1 : fx;
+  fy = fy < 1 ? 1 : fy;
+
+  // pixel i covers [i, i + 1) while src_x is the centre of the dst pixel
+  float x0 = add_rn(add_rn(src_x, 0.5f), mul_rn(fx, -0.5f)), x1 = add_rn(x0, fx);
+  float y0 = add_rn(add_rn(src_y, 0.5f), mul_rn(fy, -0.5f)), y1 = add_rn(y0, fy);
+  if (x1 <= 0 || x0 >= src.width || y1 <= 0 || y0 >= src.height) {
+    c0 = const_value;
+    c1 = const_value;
+    c2 = const_value;
+    return;
+  }
+
+  float sum[] = {0, 0, 0};
+  int ix_end = ceilf(x1), iy_end = ceilf(y1);
+  for (int iy = floorf(y0); iy < iy_end; ++iy) {
+    float wy = add_rn(fminf(y1, iy + 1), -fmaxf(y0, iy));
+    for (int ix = floorf(x0); ix < ix_end; ++ix) {
+      float w = mul_rn(wy, add_rn(fminf(x1, ix + 1), -fmaxf(x0, ix)));
+      uint8_t v[] = {const_value, const_value, const_value};
+      if (ix >= 0 && ix < src.width && iy >= 0 && iy < src.height) fetch_bgr(src, ix, iy, v);
+
+      sum[0] = add_rn(sum[0], mul_rn(w, v[0]));
+      sum[1] = add_rn(sum[1], mul_rn(w, v[1]));
+      sum[2] = add_rn(sum[2], mul_rn(w, v[2]));
+    }
+  }
+
+  float inv_area = 1.0f / mul_rn(fx, fy);
+  c0 = floorf(add_rn(mul_rn(sum[0], inv_area), 0.5f));
+  c1 = floorf(add_rn(mul_rn(sum[1], inv_area), 0.5f));
+  c2 = floorf(add_rn(mul_rn(sum[2], inv_area), 0.5f));
+}
+
+// Norm folded into out = x * scale + offset, the division by std is precomputed. out_scale is
+// the reciprocal quantization scale of an int8 input binding.
+struct NormParams {
+  float scale[3];
+  float offset[3];
+  float out_scale;
+};
+
+inline NormParams fold_norm(const Norm &norm, float int8_scale = 1.0f) {
+  NormParams params;
+  params.out_scale = 1.0f / int8_scale;
+  for (int i = 0; i < 3; ++i) {
+    if (norm.type == NormType::MeanStd) {
+      params.scale[i] = norm.alpha / norm.std[i];
+      params.offset[i] = -norm.mean[i] / norm.std[i];
+    } else if (norm.type == NormType::AlphaBeta) {
+      params.scale[i] = norm.alpha;
+      params.offset[i] = norm.beta;
+    } else {
+      params.scale[i] = 1.0f;
+      params.offset[i] = 0.0f;
+    }
+  }
+  return params;
+}
+
+// dst to image, passed by value so that every thread has it in registers
+struct Matrix2x3 {
+  float m[6];
+};
+
+inline Matrix2x3 make_matrix(const float *matrix_2_3) {
+  Matrix2x3 out;
+  for (int i = 0; i < 6; ++i) out.m[i] = matrix_2_3[i];
+  return out;
+}
+
+// round half to even and saturate, nan goes to the lower bound
+HOST_DEVICE inline int saturate_round(float value, float low, float high) {
+  value = value > low ? value : low;
+  value = value < high ? value : high;
+#ifdef __CUDA_ARCH__
+  return __float2int_rn(value);
+#else
+  return (int)nearbyintf(value);
+#endif
+}
+
+// Output pixel at index (dy * width + dx), planar [3, height, width] for float, half and int8,
+// interleaved [height, width, 3] for uint8 whose engine normalizes by itself.
+HOST_DEVICE inline void store_pixel(float c0, float c1, float c2, const NormParams &norm,
+                                    float *dst, int index, int area) {
+  dst[index] = c0;
+  dst[index + area] = c1;
+  dst[index + area * 2] = c2;
+}
+
+#ifdef __CUDACC__
+HOST_DEVICE inline void store_pixel(float c0, float c1, float c2, const NormParams &norm,
+                                    __half *dst, int index, int area) {
+  dst[index] = __float2half_rn(c0);
+  dst[index + area] = __float2half_rn(c1);
+  dst[index + area * 2] = __float2half_rn(c2);
+}
+#endif
+
+HOST_DEVICE inline void store_pixel(float c0, float c1, float c2, const NormParams &norm,
+                                    int8_t *dst, int index, int area) {
+  dst[index] = saturate_round(mul_rn(c0, norm.out_scale), -128, 127);
+  dst[index + area] = saturate_round(mul_rn(c1, norm.out_scale), -128, 127);
+  dst[index + area * 2] = saturate_round(mul_rn(c2, norm.out_scale), -128, 127);
+}
+
+HOST_DEVICE inline void store_pixel(float c0, float c1, float c2, const NormParams &norm,
+                                    uint8_t *dst, int index, int area) {
+  uint8_t *pdst = dst + index * 3;
+  pdst[0] = saturate_round(c0, 0, 255);
+  pdst[1] = saturate_round(c1, 0, 255);
+  pdst[2] = saturate_round(c2, 0, 255);
+}
+
+// One output pixel of the letterbox preprocess, the branches on the template parameters are
+// resolved at compile time.
+template <NormType norm_type, ChannelType channel_type, Interp interp, typename TOut>
+HOST_DEVICE inline void warp_affine_pixel(const PlaneView &src, const Matrix2x3 &matrix,
+                                          const NormParams &norm, uint8_t const_value, int dx,
+                                          int dy, int dst_width, int area, TOut *dst) {
+  float src_x = add_rn(add_rn(mul_rn(matrix.m[0], dx), mul_rn(matrix.m[1], dy)), matrix.m[2]);
+  float src_y = add_rn(add_rn(mul_rn(matrix.m[3], dx), mul_rn(matrix.m[4], dy)), matrix.m[5]);
+  float c0, c1, c2;
+  if (interp == Interp::Nearest) {
+    nearest_sample(src, src_x, src_y, const_value, c0, c1, c2);
+  } else if (interp == Interp::Area) {
+    // size of one dst pixel in the image
+    float fx = add_rn(fabsf(matrix.m[0]), fabsf(matrix.m[1]));
+    float fy = add_rn(fabsf(matrix.m[3]), fabsf(matrix.m[4]));
+    area_sample(src, src_x, src_y, fx, fy, const_value, c0, c1, c2);
+  } else {
+    bilinear_sample(src, src_x, src_y, const_value, c0, c1, c2);
+  }
+
+  if (channel_type == ChannelType::SwapRB) {
+    float t = c2;
+    c2 = c0;
+    c0 = t;
+  }
+
+  if (norm_type != NormType::None) {
+    c0 = add_rn(mul_rn(c0, norm.scale[0]), norm.offset[0]);
+    c1 = add_rn(mul_rn(c1, norm.scale[1]), norm.offset[1]);
+    c2 = add_rn(mul_rn(c2, norm.scale[2]), norm.offset[2]);
+  }
+
+  store_pixel(c0, c1, c2, norm, dst, dy * dst_width + dx, area);
+}
+
+// Heads are read in the dtype of their binding, half is widened per element in registers
+HOST_DEVICE inline float load_value(const float *p) { return *p; }
+
+#ifdef __CUDACC__
+HOST_DEVICE inline float load_value(const __half *p) { return __half2float(*p); }
+#endif
+
+// First maximum of scores[0 .. num_classes). NUM_CLASSES > 0 fixes the count at compile time so
+// that the loop is unrolled, 0 takes num_classes at runtime.
+template <int NUM_CLASSES, typename T>
+HOST_DEVICE inline void argmax_classes(const T *scores, int num_classes, float &confidence,
+                                       int &label) {
+  const int n = NUM_CLASSES > 0 ? NUM_CLASSES : num_classes;
+  confidence = load_value(scores);
+  label = 0;
+#ifdef __CUDA_ARCH__
+#pragma unroll
+#endif
+  for (int i = 1; i < n; ++i) {
+    float value = load_value(scores + i);
+    if (value > confidence) {
+      confidence = value;
+      label = i;
+    }
+  }
+}
+
+// Calls Launcher<T, NUM_CLASSES>::run(args...) with a specialized class count for coco (80) and
+// small custom models (1 to 10), other counts take the generic NUM_CLASSES = 0.
+template <template <typename, int> class Launcher, typename T, typename... Args>
+inline void dispatch_num_classes(int num_classes, Args &&...args) {
+  switch (num_classes) {
+    case 1: Launcher<T, 1>::run(args...); break;
+    case 2: Launcher<T, 2>::run(args...); break;
+    case 3: Launcher<T, 3>::run(args...); break;
+    case 4: Launcher<T, 4>::run(args...); break;
+    case 5: Launcher<T, 5>::run(args...); break;
+    case 6: Launcher<T, 6>::run(args...); break;
+    case 7: Launcher<T, 7>::run(args...); break;
+    case 8: Launcher<T, 8>::run(args...); break;
+    case 9: Launcher<T, 9>::run(args...); break;
+    case 10: Launcher<T, 10>::run(args...); break;
+    case 80: Launcher<T, 80>::run(args...); break;
+    default: Launcher<T, 0>::run(args...); break;
+  }
+}
+
+// Calls Launcher<norm_type, channel_type, interp, TOut>::run(args...) for the runtime choice,
+// both the cuda kernels and the cpu rows are instantiated through it.
+template <template <NormType, ChannelType, Interp, typename> class Launcher, typename TOut,
+          NormType norm_type, ChannelType channel_type, typename... Args>
+inline void dispatch_interp(Interp interp, Args &&...args) {
+  switch (interp) {
+    case Interp::Nearest:
+      Launcher<norm_type, channel_type, Interp::Nearest, TOut>::run(args...);
+      break;
+    case Interp::Area:
+      Launcher<norm_type, channel_type, Interp::Area, TOut>::run(args...);
+      break;
+    default:
+      Launcher<norm_type, channel_type, Interp::Bilinear, TOut>::run(args...);
+      break;
+  }
+}
+
+template <template <NormType, ChannelType, Interp, typename> class Launcher, typename TOut,
+          NormType norm_type, typename... Args>
+inline void dispatch_channel(ChannelType channel_type, Interp interp, Args &&...args) {
+  if (channel_type == ChannelType::SwapRB)
+    dispatch_interp<Launcher, TOut, norm_type, ChannelType::SwapRB>(interp, args...);
+  else
+    dispatch_interp<Launcher, TOut, norm_type, ChannelType::None>(interp, args...);
+}
+
+template <template <NormType, ChannelType, Interp, typename> class Launcher, typename TOut,
+          typename... Args>
+inline void dispatch_preprocess(const Norm &norm, Interp interp, Args &&...args) {
+  switch (norm.type) {
+    case NormType::MeanStd:
+      dispatch_channel<Launcher, TOut, NormType::MeanStd>(norm.channel_type, interp, args...);
+      break;
+    case NormType::AlphaBeta:
+      dispatch_channel<Launcher, TOut, NormType::AlphaBeta>(norm.channel_type, interp, args...);
+      break;
+    default:
+      dispatch_channel<Launcher, TOut, NormType::None>(norm.channel_type, interp, args...);
+      break;
+  }
+}
+
+};  // namespace yolo
+
+#endif  // __YOLO_KERNEL_HPP__